@@ -20,9 +20,19 @@ class ExtType(namedtuple('ExtType', 'code data')):
 import os
 if os.environ.get('MSGPACK_PUREPYTHON'):
     from msgpack_rlp.fallback import Packer, unpackb, Unpacker
+
+    def packb(o, **kwargs):
+        """
+        Pack object `o` and return packed bytes
+
+        See :class:`Packer` for options.
+        """
+        return Packer(**kwargs).pack(o)
 else:
     #try:
-    from msgpack_rlp._packer import Packer
+    from msgpack_rlp._packer import (Packer, packb, pack_and_hash, encoded_length, ListBuilder,
+                                     FileListEncoder, RLPRaw, Sedes, write_segments, register_type,
+                                     unregister_type, buffer_arena_stats, configure_buffer_arena)
     from msgpack_rlp._unpacker import unpackb, Unpacker
     #except ImportError:
     #    from msgpack.fallback import Packer, unpackb, Unpacker
@@ -34,17 +44,7 @@ def pack(o, stream, **kwargs):
 
     See :class:`Packer` for options.
     """
-    packer = Packer(**kwargs)
-    stream.write(packer.pack(o))
-
-
-def packb(o, **kwargs):
-    """
-    Pack object `o` and return packed bytes
-
-    See :class:`Packer` for options.
-    """
-    return Packer(**kwargs).pack(o)
+    stream.write(packb(o, **kwargs))
 
 
 def unpack(stream, **kwargs):
@@ -4,16 +4,20 @@
 from cpython cimport *
 from cpython.version cimport PY_MAJOR_VERSION
 from cpython.exc cimport PyErr_WarnEx
+from cpython cimport array
+from libc.string cimport memcpy, strerror
+import array
+import os
+import sys
+import tempfile
+import threading
 
-from msgpack_rlp.exceptions import PackValueError, PackOverflowError
+from msgpack_rlp.exceptions import PackValueError
 
 
 cdef extern from "Python.h":
 
-    int PyMemoryView_Check(object obj)
-    int PyByteArray_Check(object obj)
-    int PyByteArray_CheckExact(object obj)
-    char* PyUnicode_AsUTF8AndSize(object obj, Py_ssize_t *l) except NULL
+    int PyObject_AsFileDescriptor(object o) except -1
 
 
 cdef extern from "pack.h":
@@ -22,6 +26,7 @@ cdef extern from "pack.h":
         size_t length
         size_t buf_size
         bint use_bin_type
+        bint fixed
 
     int msgpack_pack_int(msgpack_packer* pk, int d)
     int msgpack_pack_nil(msgpack_packer* pk)
@@ -32,27 +37,311 @@ cdef extern from "pack.h":
     int msgpack_pack_unsigned_long_long(msgpack_packer* pk, unsigned long long d)
     int msgpack_pack_float(msgpack_packer* pk, float d)
     int msgpack_pack_double(msgpack_packer* pk, double d)
-    int msgpack_pack_array(msgpack_packer* pk, size_t l, size_t position)
-    int msgpack_clear_spot_for_start_byte(msgpack_packer* pk)
+    int msgpack_pack_array(msgpack_packer* pk, size_t l)
     int msgpack_pack_map(msgpack_packer* pk, size_t l)
     int msgpack_pack_raw(msgpack_packer* pk, size_t l)
     int msgpack_pack_bin(msgpack_packer* pk, size_t l)
     int msgpack_pack_raw_body(msgpack_packer* pk, char* body, size_t l)
     int msgpack_pack_ext(msgpack_packer* pk, char typecode, size_t l)
     int msgpack_pack_unicode(msgpack_packer* pk, object o, long long limit)
+    int msgpack_pack_reserve(msgpack_packer* pk, size_t l)
+    void msgpack_pack_trim(msgpack_packer* pk)
+    size_t msgpack_pack_header_size(size_t l)
+    size_t msgpack_pack_uint64_size(unsigned long long d)
+    size_t msgpack_pack_array_before(char* payload, size_t l)
+    enum: MSGPACK_MAX_HEADER_SIZE
+
+
+    struct msgpack_arena:
+        size_t high_water
+        size_t trim_size
+        size_t cached_bytes
+        size_t peak_cached_bytes
+        size_t hits
+        size_t misses
+        size_t releases
+        size_t evictions
+        size_t trims
+
+    msgpack_arena msgpack_buffer_arena
+    void msgpack_arena_release(char* buf, size_t size)
+    void msgpack_arena_configure(size_t high_water, size_t trim_size)
+
+    PyTypeObject* msgpack_raw_type
+    PyObject* msgpack_type_registry
+    PyObject* msgpack_fields_attr
+    object msgpack_fields_compile(PyTypeObject* t, object names)
+
+    struct msgpack_memo_cache:
+        size_t capacity
+        size_t length
+        size_t hits
+        size_t misses
+        size_t evictions
+
+    struct msgpack_memo:
+        msgpack_memo_cache cache
+        size_t shared
+
+    msgpack_memo* msgpack_memo_new(size_t capacity) except NULL
+    void msgpack_memo_free(msgpack_memo* memo)
+    void msgpack_memo_cache_clear(msgpack_memo_cache* c)
+
+    struct msgpack_sede:
+        size_t size
+
+    struct msgpack_sedes:
+        msgpack_sede* nodes
+
+    int msgpack_sedes_compile(msgpack_sedes* s, object spec) except -1
+    void msgpack_sedes_free(msgpack_sedes* s)
+
+    struct msgpack_encoder:
+        PyObject* default_fn
+        bint strict_types
+        size_t max_depth
+        PyObject* error_obj
+        msgpack_plan plan
+        msgpack_memo* memo
+        const msgpack_sedes* sedes
+
+    int MSGPACK_ENCODE_ERROR
+    int MSGPACK_ENCODE_NEGATIVE
+    int MSGPACK_ENCODE_DEPTH
+    int MSGPACK_ENCODE_UNSUPPORTED
+    int MSGPACK_ENCODE_TOO_LARGE
+    int MSGPACK_ENCODE_CHANGED
+    int MSGPACK_ENCODE_SCHEMA
+
+    struct msgpack_plan:
+        pass
+
+    void msgpack_encoder_init(msgpack_encoder* enc)
+    void msgpack_encoder_reset(msgpack_encoder* enc)
+    void msgpack_encoder_free(msgpack_encoder* enc)
+    int msgpack_encode(msgpack_encoder* enc, msgpack_packer* pk, object o)
+    int msgpack_encode_bytes(msgpack_encoder* enc, object o, PyObject** result)
+    int msgpack_encode_into(msgpack_encoder* enc, object o, char* buf, size_t avail, size_t* size)
+    int msgpack_encoded_length(msgpack_encoder* enc, object o, size_t* size)
+    int msgpack_encode_hash(msgpack_encoder* enc, object o, PyObject** result,
+                            unsigned char* digest)
+
+
+cdef extern from "batch.h":
+    struct msgpack_batch:
+        Py_ssize_t count
+        size_t* starts
+
+    void msgpack_batch_init(msgpack_batch* b)
+    void msgpack_batch_free(msgpack_batch* b)
+    int msgpack_batch_snapshot(msgpack_encoder* enc, msgpack_batch* b, object seq,
+                               bint borrow_buffers)
+    bint msgpack_batch_write(msgpack_encoder* enc, msgpack_batch* b, char* out, size_t threads) nogil
+
+
+cdef extern from "segments.h":
+    ctypedef struct msgpack_iovec:
+        void* iov_base
+        size_t iov_len
+
+    struct msgpack_segment:
+        PyObject* object
+        size_t start
+        size_t length
+
+    struct msgpack_segments:
+        msgpack_packer head
+        msgpack_segment* items
+        size_t length
+
+    void msgpack_segments_init(msgpack_segments* sg)
+    void msgpack_segments_free(msgpack_segments* sg)
+    int msgpack_segments_build(msgpack_segments* sg, msgpack_encoder* enc, msgpack_batch* b, size_t threshold) except -1
+    int msgpack_write_iovec(int fd, msgpack_iovec* iov, size_t n) nogil
+
+
+cdef extern from "columns.h":
+    struct msgpack_columns:
+        pass
+
+    void msgpack_columns_init(msgpack_columns* c)
+    void msgpack_columns_free(msgpack_columns* c)
+    int msgpack_columns_open(msgpack_columns* c, msgpack_encoder* enc, object columns) except -1
+    int msgpack_encode_columns(msgpack_encoder* enc, msgpack_columns* c, PyObject** result)
+
+
+cdef extern from "filelist.h":
+    int msgpack_file_list_finish(int scratch, int out, unsigned long long payload) nogil
+    void msgpack_file_list_discard(int scratch, const char* path)
 
 
 cdef int DEFAULT_RECURSE_LIMIT=511
-#from https://github.com/ethereum/wiki/wiki/RLP
-cdef unsigned long long ITEM_LIMIT = (2**64)-1
+# offsets returned by pack_many, 'Q' is missing from python 2's array module
+try:
+    OFFSETS_TYPECODE = 'Q'
+    array.array(OFFSETS_TYPECODE)
+except ValueError:
+    OFFSETS_TYPECODE = 'L'
+cdef array.array offsets_template = array.array(OFFSETS_TYPECODE)
+
+
+cdef int raise_encode_error(msgpack_encoder* enc, int ret) except -1:
+    """Turns an error code of the C encoder into the matching exception."""
+    cdef object obj = None
+    if enc.error_obj != NULL:
+        obj = <object>enc.error_obj
+        Py_CLEAR(enc.error_obj)
+    if ret == MSGPACK_ENCODE_ERROR:
+        # the exception is already set
+        return -1
+    elif ret == MSGPACK_ENCODE_NEGATIVE:
+        raise PackValueError("Cannot encode negative numbers to big endian int.")
+    elif ret == MSGPACK_ENCODE_DEPTH:
+        raise PackValueError("recursion limit exceeded.")
+    elif ret == MSGPACK_ENCODE_UNSUPPORTED:
+        raise TypeError("can't serialize %r" % (obj,))
+    elif ret == MSGPACK_ENCODE_TOO_LARGE:
+        raise PackValueError("%s is too large" % type(obj).__name__)
+    elif ret == MSGPACK_ENCODE_CHANGED:
+        raise RuntimeError("object changed size during packing")
+    elif ret == MSGPACK_ENCODE_SCHEMA:
+        raise PackValueError("%r doesn't match the sedes" % (obj,))
+    raise RuntimeError("internal error")
+
+
+cdef bint is_single_item(const unsigned char* p, Py_ssize_t n):
+    """Whether the outermost prefix of p covers exactly n bytes."""
+    cdef unsigned char b
+    cdef Py_ssize_t lenlen, i
+    cdef unsigned long long l = 0
+    if n == 0:
+        return False
+    b = p[0]
+    if b < 0x80:
+        return n == 1
+    elif b < 0xb8:
+        return n == 1 + b - 0x80
+    elif b < 0xc0:
+        lenlen = b - 0xb7
+    elif b < 0xf8:
+        return n == 1 + b - 0xc0
+    else:
+        lenlen = b - 0xf7
+    if n < 1 + lenlen:
+        return False
+    for i in range(lenlen):
+        l = (l << 8) | p[1 + i]
+    return <unsigned long long>(n - 1 - lenlen) == l
+
+
+class RLPRaw(bytes):
+    """
+    An already encoded RLP item (a cached header, a received transaction...).
 
+    Packer writes it verbatim wherever it appears, counting its full length
+    toward the enclosing list. Only the outermost prefix is checked: it must
+    cover exactly the given bytes.
+    """
+    def __new__(cls, data):
+        self = bytes.__new__(cls, data)
+        if not is_single_item(self, len(self)):
+            raise ValueError("RLPRaw expects exactly one encoded item.")
+        return self
+
+    def __repr__(self):
+        return 'RLPRaw(%s)' % (bytes.__repr__(self),)
+
+msgpack_raw_type = <PyTypeObject*>RLPRaw
+
+
+# type -> compiled field layout, read by the C encoder
+cdef dict type_registry = {}
+cdef object fields_attr = intern('__rlp_fields__')
+msgpack_type_registry = <PyObject*>type_registry
+msgpack_fields_attr = <PyObject*>fields_attr
+
+def register_type(type cls, fields=None):
+    """
+    Pack instances of `cls` as the list of their attributes named in
+    `fields`, without calling `default`. The names default to the
+    ``__rlp_fields__`` attribute of the class; classes that have one are
+    registered on first use anyway.
+
+    The names are resolved once, so register the class again after changing
+    its attributes. Fields kept in ``__slots__`` are the fastest to read.
+    """
+    if fields is None:
+        fields = getattr(cls, '__rlp_fields__', None)
+        if fields is None:
+            raise TypeError("%s has no __rlp_fields__, fields are required" % (cls.__name__,))
+    type_registry[cls] = msgpack_fields_compile(<PyTypeObject*>cls, fields)
 
-cdef inline int PyBytesLike_Check(object o):
-    return PyBytes_Check(o) or PyByteArray_Check(o)
+def unregister_type(type cls):
+    """Forget the fields registered for `cls`."""
+    type_registry.pop(cls, None)
 
 
-cdef inline int PyBytesLike_CheckExact(object o):
-    return PyBytes_CheckExact(o) or PyByteArray_CheckExact(o)
+cdef class Sedes(object):
+    """
+    Sedes compiled for :class:`Packer`.
+
+    In `spec`, 0 is bytes, 1 an unsigned int of at most 64 bits, ``(0, n)``
+    bytes of exactly n bytes, ``(1, n)`` an unsigned int of at most n bytes
+    (``(1, 32)`` for 256 bit values), a list of one sedes is a list of any
+    length whose items all have it and any other list is a record with one
+    sedes per item. Unlike the sedes of :func:`unpackb`, where an int covers a
+    whole subtree, 0 and 1 never match a list: ``[1, 0]`` rejects
+    ``[5, [b'a']]``, ``[1, [0]]`` is needed.
+    """
+    cdef msgpack_sedes sedes
+    cdef readonly object spec
+
+    def __cinit__(self, spec):
+        msgpack_sedes_compile(&self.sedes, spec)
+        self.spec = spec
+
+    def __dealloc__(self):
+        msgpack_sedes_free(&self.sedes)
+
+    property fixed_size:
+        """Encoded size of every value of this sedes, or None when it varies."""
+        def __get__(self):
+            cdef size_t size = self.sedes.nodes[0].size
+            return size if size else None
+
+    def __repr__(self):
+        return 'Sedes(%r)' % (self.spec,)
+
+
+def buffer_arena_stats():
+    """
+    Statistics of the process wide arena that Packers borrow their internal
+    buffers from, as a dict.
+    """
+    cdef msgpack_arena* a = &msgpack_buffer_arena
+    return {
+        'high_water': a.high_water,
+        'trim_size': a.trim_size,
+        'cached_bytes': a.cached_bytes,
+        'peak_cached_bytes': a.peak_cached_bytes,
+        'hits': a.hits,
+        'misses': a.misses,
+        'releases': a.releases,
+        'evictions': a.evictions,
+        'trims': a.trims,
+    }
+
+
+def configure_buffer_arena(high_water=None, trim_size=None):
+    """
+    Set the most bytes the buffer arena keeps cached (high_water) and the size
+    above which an emptied Packer buffer is given back to it (trim_size).
+    Lowering high_water frees cached buffers right away.
+    """
+    cdef msgpack_arena* a = &msgpack_buffer_arena
+    cdef size_t hw = a.high_water if high_water is None else high_water
+    cdef size_t ts = a.trim_size if trim_size is None else trim_size
+    msgpack_arena_configure(hw, ts)
 
 
 cdef class Packer(object):
@@ -67,6 +356,19 @@ cdef class Packer(object):
 
     Packer's constructor has some keyword arguments:
 
+    Iterators and generators are packed as lists, item by item as they are
+    produced, and so are other iterables except dicts and buffers, though
+    default() is called on those first when given: returning them unchanged
+    has them packed as lists. Objects with a contiguous buffer (memoryview,
+    array, mmap, ...) are packed as strings, read in place, except arrays of
+    unsigned ints (typecodes I, L and Q), which are packed as lists of
+    integers. Instances of classes passed to :func:`register_type`, or with
+    an ``__rlp_fields__`` attribute, are packed as the list of their named
+    attributes.
+
+    A Packer packs one object at a time: using it again from default(), a
+    generator or an attribute it is reading raises RuntimeError.
+
     :param callable default:
         Convert user type to builtin type that Packer supports.
         See also simplejson's document.
@@ -88,10 +390,36 @@ cdef class Packer(object):
         If set to true, types will be checked to be exact. Derived classes
         from serializeable types will not be serialized and will be
         treated as unsupported type and forwarded to default.
-        Additionally tuples will not be serialized as lists.
+        Additionally tuples and iterables other than iterators will not be
+        serialized as lists, nor buffer objects other than memoryview as
+        strings.
         This is useful when trying to implement accurate serialization
         for python types.
 
+    :param int max_depth:
+        Deepest list nesting to encode, the object itself being depth 0.
+        Nesting only costs heap memory, this is just a guard against
+        runaway or self-referencing structures. (default: 511)
+
+    :param bool memoize:
+        Remember what was packed. Within one call, a list or tuple met again
+        (the same object) is copied from its first encoding instead of being
+        walked again; across calls, the encodings of the last `memo_size`
+        tuples made only of bytes, ints, str and None (nested tuples
+        included) are kept and reused for equal tuples. See
+        :meth:`memo_stats`. (default: False)
+
+    :param int memo_size:
+        Most tuple encodings kept across calls when memoize is set, 0 to only
+        share within calls. (default: 1024)
+
+    :param sedes:
+        Pack every object by this :class:`Sedes` (or spec to compile into
+        one) instead of by its type. Values that don't match it raise
+        ValueError before anything is written, default is not called and
+        the prefix of fixed size records is not computed again. Lists of the
+        sedes can be lists, tuples or registered objects. (default: None)
+
     :param str unicode_errors:
         Error handler for encoding unicode. (default: 'strict')
 
@@ -99,7 +427,9 @@ cdef class Packer(object):
         (deprecated) Convert unicode to bytes with this encoding. (default: 'utf-8')
     """
     cdef msgpack_packer pk
+    cdef msgpack_encoder enc
     cdef object _default
+    cdef Sedes _sedes
     cdef object _bencoding
     cdef object _berrors
     cdef const char *encoding
@@ -107,18 +437,23 @@ cdef class Packer(object):
     cdef bint strict_types
     cdef bool use_float
     cdef bint autoreset
+    cdef bint busy          # a call is using enc or the internal buffer
 
     def __cinit__(self):
-        cdef int buf_size = 1024*2024
-        self.pk.buf = <char*> PyMem_Malloc(buf_size)
-        if self.pk.buf == NULL:
-            raise MemoryError("Unable to allocate internal buffer.")
-        self.pk.buf_size = buf_size
+        # the internal buffer is borrowed from the buffer arena on first use
+        self.pk.buf = NULL
+        self.pk.buf_size = 0
         self.pk.length = 0
+        self.busy = False
+        msgpack_encoder_init(&self.enc)
+        self.enc.max_depth = DEFAULT_RECURSE_LIMIT
 
     def __init__(self, default=None, encoding=None, unicode_errors=None,
                  bint use_single_float=False, bint autoreset=True, bint use_bin_type=False,
-                 bint strict_types=False):
+                 bint strict_types=False, Py_ssize_t max_depth=DEFAULT_RECURSE_LIMIT,
+                 bint memoize=False, Py_ssize_t memo_size=1024, sedes=None):
+        if self.busy:
+            raise RuntimeError("Packer is already packing")
         if encoding is not None:
             PyErr_WarnEx(PendingDeprecationWarning, "encoding is deprecated.", 1)
         self.use_float = use_single_float
@@ -129,6 +464,25 @@ cdef class Packer(object):
             if not PyCallable_Check(default):
                 raise TypeError("default must be a callable.")
         self._default = default
+        self.enc.default_fn = NULL
+        if default is not None:
+            self.enc.default_fn = <PyObject*>default
+        self.enc.strict_types = strict_types
+        if max_depth < 0:
+            raise ValueError("max_depth must be positive.")
+        self.enc.max_depth = max_depth
+        if memo_size < 0:
+            raise ValueError("memo_size must be positive.")
+        msgpack_memo_free(self.enc.memo)
+        self.enc.memo = NULL
+        if memoize:
+            self.enc.memo = msgpack_memo_new(memo_size)
+        self.enc.sedes = NULL
+        if sedes is not None and not isinstance(sedes, Sedes):
+            sedes = Sedes(sedes)
+        self._sedes = sedes
+        if sedes is not None:
+            self.enc.sedes = &self._sedes.sedes
 
         self._bencoding = encoding
         if encoding is None:
@@ -146,126 +500,663 @@ cdef class Packer(object):
             self.unicode_errors = self._berrors
 
     def __dealloc__(self):
-        PyMem_Free(self.pk.buf)
+        msgpack_arena_release(self.pk.buf, self.pk.buf_size)
         self.pk.buf = NULL
+        msgpack_encoder_free(&self.enc)
+
+    cdef int _acquire(self) except -1:
+        # the plan and frame stack of enc hold the state of the call in
+        # progress, which a nested call from Python code run while packing
+        # would overwrite
+        if self.busy:
+            raise RuntimeError("Packer is already packing")
+        self.busy = True
+        return 0
+
+    cdef int _pack(self, object o) except -1:
+        cdef int ret = msgpack_encode(&self.enc, &self.pk, o)
+        if ret != 0:
+            raise_encode_error(&self.enc, ret)
+        return ret
 
-    cdef int _pack(self, object o, int nest_limit=DEFAULT_RECURSE_LIMIT) except -1:
-        cdef long long llval
-        cdef unsigned long long ullval
-        cdef long longval
-        cdef float fval
-        cdef double dval
-        cdef char* rawval
+    cpdef pack(self, object obj):
+        cdef PyObject* res = NULL
+        cdef int ret
+        self._acquire()
+        try:
+            if self.autoreset and self.pk.length == 0:
+                # the sizing pass gives the exact length, so the bytes object
+                # itself is the output buffer and is handed out as is
+                ret = msgpack_encode_bytes(&self.enc, obj, &res)
+                if ret != 0:
+                    raise_encode_error(&self.enc, ret)
+                buf = <object>res
+                Py_DECREF(buf)
+                return buf
+            try:
+                self._pack(obj)
+            except:
+                self.pk.length = 0
+                msgpack_pack_trim(&self.pk)
+                raise
+            buf = PyBytes_FromStringAndSize(self.pk.buf, self.pk.length)
+            if self.autoreset:
+                self.pk.length = 0
+                msgpack_pack_trim(&self.pk)
+            return buf
+        finally:
+            self.busy = False
+
+    def encoded_length(self, object obj):
+        """
+        Return the length of the packed form of obj without packing it.
+
+        obj is read as :meth:`pack` would read it: default() is called, and
+        iterators and generators are consumed. Packing such an object
+        afterwards packs what is left of it, an empty list for a generator.
+        """
+        cdef size_t size = 0
+        cdef int ret
+        self._acquire()
+        try:
+            ret = msgpack_encoded_length(&self.enc, obj, &size)
+            if ret != 0:
+                raise_encode_error(&self.enc, ret)
+        finally:
+            self.busy = False
+        return size
+
+    def pack_and_hash(self, object obj, bint digest_only=False):
+        """
+        Pack obj and hash the packed bytes with Keccak-256 (the one of
+        Ethereum, not the final SHA3-256) as they are written, rather than
+        reading them back afterwards.
+
+        Returns ``(packed, digest)``, or only the 32 byte digest when
+        digest_only is set; then the packed bytes are never kept whole.
+        """
+        cdef PyObject* res = NULL
+        cdef unsigned char digest[32]
         cdef int ret
-        cdef dict d
-        cdef Py_ssize_t L
-        cdef int default_used = 0
-        cdef bint strict_types = self.strict_types
+        self._acquire()
+        try:
+            ret = msgpack_encode_hash(&self.enc, obj, NULL if digest_only else &res, digest)
+            if ret != 0:
+                raise_encode_error(&self.enc, ret)
+        finally:
+            self.busy = False
+        if digest_only:
+            return PyBytes_FromStringAndSize(<char*>digest, 32)
+        buf = <object>res
+        Py_DECREF(buf)
+        return buf, PyBytes_FromStringAndSize(<char*>digest, 32)
+
+    def pack_into(self, object obj, object buffer, Py_ssize_t offset=0):
+        """
+        Pack obj directly into the writable buffer (bytearray, memoryview,
+        mmap, ...) starting at offset, without going through the internal
+        buffer.
+
+        Returns the number of bytes written. When the space left after offset
+        is too small nothing is written and the required size is returned
+        instead, so a result larger than ``len(buffer) - offset`` means the
+        call has to be repeated with a bigger buffer.
+        """
         cdef Py_buffer view
+        cdef size_t size = 0
+        cdef int ret
+        self._acquire()
+        try:
+            PyObject_GetBuffer(buffer, &view, PyBUF_WRITABLE)
+            try:
+                if offset < 0 or offset > view.len:
+                    raise ValueError("offset out of range.")
+                ret = msgpack_encode_into(&self.enc, obj, <char*>view.buf + offset,
+                                          view.len - offset, &size)
+                if ret != 0:
+                    raise_encode_error(&self.enc, ret)
+            finally:
+                PyBuffer_Release(&view)
+        finally:
+            self.busy = False
+        return size
 
-        if nest_limit < 0:
-            raise PackValueError("recursion limit exceeded.")
-
-        while True:
-            if o is None:
-                ret = msgpack_pack_nil(&self.pk)
-
-            elif PyBytesLike_CheckExact(o) if strict_types else PyBytesLike_Check(o):
-                #this is a python byte array
-                L = len(o)
-                if L > ITEM_LIMIT:
-                    raise PackValueError("%s is too large" % type(o).__name__)
-                rawval = o
-                #ret = msgpack_pack_bin(&self.pk, L)
-                #we don't have a special type for binary, so lets skip this and use the same function as unicode
-                if L == 1 and ord(o) < 0x80:
-                    #print('encoding single byte as is')
-                    ret = msgpack_pack_raw_body(&self.pk, rawval, L)
-                else:
-                    #print('encoding byte string normally')
-                    #print('length = {}'.format(L))
-                    ret = msgpack_pack_raw(&self.pk, L)
-                    if ret == 0:
-                        ret = msgpack_pack_raw_body(&self.pk, rawval, L)
-
-            elif PyUnicode_CheckExact(o) if strict_types else PyUnicode_Check(o):
-                ret = msgpack_pack_unicode(&self.pk, o, ITEM_LIMIT);
-                if ret == -2:
-                    raise PackValueError("unicode string is too large")
-
-
-            elif PyLong_CheckExact(o) if strict_types else PyLong_Check(o):
-                # PyInt_Check(long) is True for Python 3.
-                # So we should test long before int.
-                try:
-                    if o == 0:
-                        #This is a special case. the integer 0 is treated as zero bytes, or an empty string
-                        ret = msgpack_pack_raw(&self.pk, 0)
-                        if ret == 0:
-                            ret = msgpack_pack_raw_body(&self.pk, b'', 0)
-                    elif o > 0:
-                        #print("saving unsigned long")
-                        ullval = o
-                        ret = msgpack_pack_unsigned_long_long(&self.pk, ullval)
-                    else:
-                        raise PackValueError("Cannot encode negative numbers to big endian int.")
-                        # llval = o
-                        # ret = msgpack_pack_long_long(&self.pk, llval)
-                except OverflowError as oe:
-                    if not default_used and self._default is not None:
-                        o = self._default(o)
-                        default_used = True
-                        continue
-                    else:
-                        raise PackOverflowError("Integer value out of range for fast automatic sedes. Use python fallback instead")
-
-
-            elif PyList_CheckExact(o) if strict_types else (PyTuple_Check(o) or PyList_Check(o)):
-                #this is a python list
-                L = len(o)
-                if L > ITEM_LIMIT:
-                    raise PackValueError("list is too large")
-                #save a position in the buffer for the initial byte. we need to see how big the list is before we know what to write there
-                start_byte_position = self.pk.length
-                #msgpack_clear_spot_for_start_byte(&self.pk);
-                if ret == 0:
-                    for v in o:
-                        ret = self._pack(v, nest_limit-1)
-                        if ret != 0: break
-
-                total_length_of_list_in_bytes = self.pk.length - start_byte_position
-                ret = msgpack_pack_array(&self.pk, total_length_of_list_in_bytes, start_byte_position);
-
-            elif not default_used and self._default:
-                #this allows for adding additional objects
-                o = self._default(o)
-                default_used = 1
-                continue
-            else:
-                raise TypeError("can't serialize %r" % (o,))
-            return ret
+    def pack_many(self, object objs):
+        """
+        Pack every object of objs back to back into a single buffer.
 
-    cpdef pack(self, object obj):
+        Returns ``(data, offsets)``: data is a bytes object and offsets an
+        ``array('Q')`` of ``len(objs) + 1`` positions in it, so the encoding of
+        the i-th object is ``data[offsets[i]:offsets[i + 1]]``.
+        """
+        cdef object seq = PySequence_Fast(objs, "pack_many() argument must be iterable")
+        cdef Py_ssize_t n = PySequence_Fast_GET_SIZE(seq)
+        cdef Py_ssize_t i
+        cdef size_t start
+        cdef array.array offsets = array.clone(offsets_template, n + 1, False)
         cdef int ret
+        self._acquire()
+        # nothing else can move the buffer once the Packer is held
+        start = self.pk.length
         try:
-            ret = self._pack(obj, DEFAULT_RECURSE_LIMIT)
+            for i in range(n + 1):
+                if i:
+                    ret = msgpack_encode(&self.enc, &self.pk,
+                                         <object>PySequence_Fast_GET_ITEM(seq, i - 1))
+                    if ret != 0:
+                        raise_encode_error(&self.enc, ret)
+                if offsets.ob_descr.itemsize == 8:
+                    (<unsigned long long*>offsets.data.as_voidptr)[i] = self.pk.length - start
+                else:
+                    (<unsigned long*>offsets.data.as_voidptr)[i] = self.pk.length - start
+            data = PyBytes_FromStringAndSize(self.pk.buf + start, self.pk.length - start)
         except:
-            self.pk.length = 0
+            self.pk.length = start
             raise
-        if ret:  # should not happen.
-            raise RuntimeError("internal error")
-        buf = PyBytes_FromStringAndSize(self.pk.buf, self.pk.length)
+        finally:
+            self.busy = False
         if self.autoreset:
             self.pk.length = 0
+            msgpack_pack_trim(&self.pk)
+        return data, offsets
+
+    def pack_batch(self, object objs, Py_ssize_t threads=0):
+        """
+        Like :meth:`pack_many`, but the output is written by up to `threads`
+        worker threads (0: one per core) with the GIL released.
+
+        The objects are first walked and snapshotted with the GIL held, so
+        default() runs on the calling thread and the objects may change once
+        the call is in the writing stage. The internal buffer is not used.
+        """
+        cdef object seq = PySequence_Fast(objs, "pack_batch() argument must be iterable")
+        cdef msgpack_batch batch
+        cdef array.array offsets
+        cdef Py_ssize_t i
+        cdef int ret
+        cdef bint ok
+        cdef char* out
+        if threads < 0:
+            raise ValueError("threads must be positive.")
+        self._acquire()
+        msgpack_batch_init(&batch)
+        try:
+            ret = msgpack_batch_snapshot(&self.enc, &batch, seq, False)
+            if ret != 0:
+                raise_encode_error(&self.enc, ret)
+            data = PyBytes_FromStringAndSize(NULL, batch.starts[batch.count])
+            out = PyBytes_AS_STRING(data)
+            with nogil:
+                ok = msgpack_batch_write(&self.enc, &batch, out, threads)
+            if not ok:
+                raise RuntimeError("batch encoding failed")
+            offsets = array.clone(offsets_template, batch.count + 1, False)
+            for i in range(batch.count + 1):
+                if offsets.ob_descr.itemsize == 8:
+                    (<unsigned long long*>offsets.data.as_voidptr)[i] = batch.starts[i]
+                else:
+                    (<unsigned long*>offsets.data.as_voidptr)[i] = batch.starts[i]
+        finally:
+            msgpack_batch_free(&batch)
+            msgpack_encoder_reset(&self.enc)
+            self.busy = False
+        return data, offsets
+
+    def pack_columns(self, object columns):
+        """
+        Pack equal length columns as the list of their rows, each row a list
+        of one item per column, as ``pack([list(row) for row in
+        zip(*columns)])`` would but without making the rows.
+
+        A column is a sequence of objects or a typed buffer read in place:
+        one dimensional unsigned ints (typecodes I, L and Q) are integers,
+        while two dimensional bytes of shape (rows, width), or one
+        dimensional fixed size bytes like numpy's ``S20``, are strings of
+        width bytes. Other buffers, like ``array('B')``, are read as
+        sequences of their items. Cells are at depth 2 for max_depth, as
+        items of the rows. With a sedes, it has to be a list of records of one
+        field per column. The internal buffer is not used.
+        """
+        cdef msgpack_columns c
+        cdef PyObject* res = NULL
+        cdef int ret
+        self._acquire()
+        msgpack_columns_init(&c)
+        try:
+            msgpack_columns_open(&c, &self.enc, columns)
+            ret = msgpack_encode_columns(&self.enc, &c, &res)
+            if ret != 0:
+                raise_encode_error(&self.enc, ret)
+        finally:
+            msgpack_columns_free(&c)
+            self.busy = False
+        buf = <object>res
+        Py_DECREF(buf)
         return buf
 
+    def pack_segments(self, object obj, Py_ssize_t threshold=4096):
+        """
+        Pack `obj` as a list of segments whose concatenation is the packed
+        data, for use with :func:`write_segments` or ``socket.sendmsg``.
+
+        bytes, RLPRaw and buffer object (memoryview, array, mmap, ...)
+        payloads of at least `threshold` bytes are returned as the objects
+        themselves instead of being copied; everything in between is returned
+        as memoryviews of a single header buffer. The internal buffer is not
+        used. Buffer objects are not copied, so they must not change until
+        the segments are written.
+        """
+        cdef msgpack_batch batch
+        cdef msgpack_segments sg
+        cdef msgpack_segment* seg
+        cdef size_t i
+        cdef int ret
+        if threshold < 1:
+            raise ValueError("threshold must be at least 1.")
+        self._acquire()
+        msgpack_batch_init(&batch)
+        msgpack_segments_init(&sg)
+        try:
+            ret = msgpack_batch_snapshot(&self.enc, &batch, (obj,), True)
+            if ret != 0:
+                raise_encode_error(&self.enc, ret)
+            msgpack_segments_build(&sg, &self.enc, &batch, threshold)
+            head = memoryview(PyBytes_FromStringAndSize(sg.head.buf, sg.head.length))
+            segments = []
+            for i in range(sg.length):
+                seg = &sg.items[i]
+                if seg.object != NULL:
+                    segments.append(<object>seg.object)
+                else:
+                    segments.append(head[seg.start:seg.start + seg.length])
+        finally:
+            msgpack_segments_free(&sg)
+            msgpack_batch_free(&batch)
+            msgpack_encoder_reset(&self.enc)
+            self.busy = False
+        return segments
+
+    def memo_stats(self):
+        """
+        Statistics of the memo as a dict: list occurrences copied within a
+        call (shared), tuple cache hits, misses and evictions, and the tuples
+        currently cached. None when the Packer doesn't memoize.
+        """
+        cdef msgpack_memo* memo = self.enc.memo
+        if memo == NULL:
+            return None
+        return {
+            'shared': memo.shared,
+            'hits': memo.cache.hits,
+            'misses': memo.cache.misses,
+            'evictions': memo.cache.evictions,
+            'entries': memo.cache.length,
+            'capacity': memo.cache.capacity,
+        }
+
+    def clear_memo(self):
+        """Drop the tuple encodings kept across calls."""
+        if self.busy:
+            raise RuntimeError("Packer is already packing")
+        if self.enc.memo != NULL:
+            msgpack_memo_cache_clear(&self.enc.memo.cache)
+
     def get_length(self):
         return self.pk.length
 
     def reset(self):
         """Clear internal buffer."""
+        if self.busy:
+            raise RuntimeError("Packer is already packing")
         self.pk.length = 0
+        msgpack_pack_trim(&self.pk)
 
     def bytes(self):
         """Return buffer content."""
         return PyBytes_FromStringAndSize(self.pk.buf, self.pk.length)
+
+
+def write_segments(fd, segments):
+    """
+    Write every buffer of `segments`, as returned by
+    :meth:`Packer.pack_segments`, to the file descriptor `fd` (an int or an
+    object with a fileno() method, such as a socket) with ``writev``.
+
+    Partial writes are continued until everything is written, so `fd` should
+    be blocking. Returns the number of bytes written.
+    """
+    cdef int fileno = PyObject_AsFileDescriptor(fd)
+    cdef object seq = PySequence_Fast(segments, "segments must be iterable")
+    cdef Py_ssize_t n = PySequence_Fast_GET_SIZE(seq)
+    cdef Py_buffer* views
+    cdef msgpack_iovec* iov
+    cdef Py_ssize_t i, got = 0
+    cdef size_t total = 0
+    cdef int err
+    if n == 0:
+        return 0
+    views = <Py_buffer*>PyMem_Malloc(n * sizeof(Py_buffer))
+    iov = <msgpack_iovec*>PyMem_Malloc(n * sizeof(msgpack_iovec))
+    try:
+        if views == NULL or iov == NULL:
+            raise MemoryError
+        for i in range(n):
+            PyObject_GetBuffer(<object>PySequence_Fast_GET_ITEM(seq, i), &views[i], PyBUF_SIMPLE)
+            got += 1
+            iov[i].iov_base = views[i].buf
+            iov[i].iov_len = views[i].len
+            total += views[i].len
+        with nogil:
+            err = msgpack_write_iovec(fileno, iov, n)
+        if err != 0:
+            raise OSError(err, strerror(err))
+    finally:
+        for i in range(got):
+            PyBuffer_Release(&views[i])
+        PyMem_Free(views)
+        PyMem_Free(iov)
+    return total
+
+
+cdef class ListBuilder(object):
+    """
+    RLP list built one item at a time.
+
+    Every appended item is packed right away, so the items don't have to be
+    kept around as a Python list. Room for the longest list prefix is left
+    in front of the payload and the prefix is filled in by :meth:`finish`,
+    so the payload is never moved.
+
+    :param Packer packer:
+        Packer whose options (default, strict_types, ...) are used to pack
+        the items. A Packer with default options when omitted.
+    """
+    cdef msgpack_packer pk
+    cdef Packer packer
+    cdef Py_ssize_t count
+
+    def __cinit__(self):
+        self.pk.buf = NULL
+        self.pk.buf_size = 0
+        self.pk.length = 0
+        self.count = 0
+
+    def __init__(self, Packer packer=None):
+        if packer is None:
+            packer = Packer()
+        self.packer = packer
+
+    def __dealloc__(self):
+        msgpack_arena_release(self.pk.buf, self.pk.buf_size)
+        self.pk.buf = NULL
+
+    def __len__(self):
+        return self.count
+
+    cdef size_t _payload_length(self):
+        if self.pk.buf == NULL:
+            return 0
+        return self.pk.length - MSGPACK_MAX_HEADER_SIZE
+
+    property payload_length:
+        """Size of the list payload packed so far."""
+        def __get__(self):
+            return self._payload_length()
+
+    def append(self, object obj):
+        """
+        Pack obj as the next item. A ListBuilder is added as a nested list of
+        what it holds now and is left unchanged.
+        """
+        cdef ListBuilder child
+        cdef size_t payload
+        cdef int ret
+        if self.pk.buf == NULL:
+            # the prefix room, the buffer is borrowed from the arena
+            if msgpack_pack_reserve(&self.pk, MSGPACK_MAX_HEADER_SIZE):
+                raise MemoryError
+            self.pk.length = MSGPACK_MAX_HEADER_SIZE
+        if type(obj) is ListBuilder:
+            child = <ListBuilder>obj
+            if child is self:
+                raise ValueError("can't append a ListBuilder to itself")
+            payload = child._payload_length()
+            if msgpack_pack_reserve(&self.pk, MSGPACK_MAX_HEADER_SIZE + payload):
+                raise MemoryError
+            msgpack_pack_array(&self.pk, payload)
+            if payload:
+                msgpack_pack_raw_body(&self.pk, child.pk.buf + MSGPACK_MAX_HEADER_SIZE, payload)
+        else:
+            self.packer._acquire()
+            try:
+                ret = msgpack_encode(&self.packer.enc, &self.pk, obj)
+                if ret != 0:
+                    raise_encode_error(&self.packer.enc, ret)
+            finally:
+                self.packer.busy = False
+        self.count += 1
+
+    def extend(self, object objs):
+        """Append every item of the iterable objs."""
+        for obj in objs:
+            self.append(obj)
+
+    def finish(self):
+        """
+        Return the packed list and empty the builder, which can then be
+        reused.
+        """
+        cdef size_t start
+        if self.pk.buf == NULL:
+            return b'\xc0'
+        start = MSGPACK_MAX_HEADER_SIZE - msgpack_pack_array_before(
+            self.pk.buf + MSGPACK_MAX_HEADER_SIZE, self._payload_length())
+        data = PyBytes_FromStringAndSize(self.pk.buf + start, self.pk.length - start)
+        self.pk.length = 0
+        self.count = 0
+        msgpack_arena_release(self.pk.buf, self.pk.buf_size)
+        self.pk.buf = NULL
+        self.pk.buf_size = 0
+        return data
+
+
+cdef class FileListEncoder(object):
+    """
+    RLP list written to the file at `path`, for lists whose payload doesn't
+    fit in memory.
+
+    Appended items are packed and streamed to a scratch file in the same
+    directory. :meth:`finish` writes the list prefix to `path` and moves the
+    payload after it with ``copy_file_range`` where the system has it, so
+    the payload doesn't pass through user space again. Used as a context
+    manager, the list is finished on success and discarded on error.
+
+    :param Packer packer:
+        Packer whose options are used to pack the items. A Packer with
+        default options when omitted.
+
+    :param int flush_size:
+        Packed items are written to the scratch file in chunks of about
+        this size.
+    """
+    cdef msgpack_packer pk
+    cdef Packer packer
+    cdef object path
+    cdef object scratch_path
+    cdef char* scratch_cpath    # for __dealloc__, which can't run Python code
+    cdef int fd
+    cdef unsigned long long flushed
+    cdef Py_ssize_t count
+    cdef size_t flush_size
+
+    def __cinit__(self):
+        self.pk.buf = NULL
+        self.pk.buf_size = 0
+        self.pk.length = 0
+        self.scratch_cpath = NULL
+        self.fd = -1
+
+    def __init__(self, path, Packer packer=None, Py_ssize_t flush_size=1024*1024):
+        if flush_size < 1:
+            raise ValueError("flush_size must be at least 1.")
+        if packer is None:
+            packer = Packer()
+        self.packer = packer
+        self.flush_size = flush_size
+        self.path = path
+        self.fd, self.scratch_path = tempfile.mkstemp(
+            suffix='.part', dir=os.path.dirname(os.path.abspath(path)))
+        scratch = self.scratch_path
+        if isinstance(scratch, unicode):
+            if PY_MAJOR_VERSION >= 3:
+                scratch = os.fsencode(scratch)
+            else:
+                scratch = scratch.encode(sys.getfilesystemencoding())
+        PyMem_Free(self.scratch_cpath)
+        self.scratch_cpath = <char*>PyMem_Malloc(len(scratch) + 1)
+        if self.scratch_cpath == NULL:
+            raise MemoryError
+        memcpy(self.scratch_cpath, <char*>scratch, len(scratch) + 1)
+
+    def __dealloc__(self):
+        if self.fd >= 0:
+            msgpack_file_list_discard(self.fd, self.scratch_cpath)
+            self.fd = -1
+        PyMem_Free(self.scratch_cpath)
+        self.scratch_cpath = NULL
+        msgpack_arena_release(self.pk.buf, self.pk.buf_size)
+        self.pk.buf = NULL
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        if exc_type is None:
+            self.finish()
+        else:
+            self.abort()
+
+    def __len__(self):
+        return self.count
+
+    property payload_length:
+        """Size of the list payload packed so far."""
+        def __get__(self):
+            return self.flushed + self.pk.length
+
+    cdef int _flush(self) except -1:
+        cdef msgpack_iovec iov
+        cdef int err
+        iov.iov_base = self.pk.buf
+        iov.iov_len = self.pk.length
+        with nogil:
+            err = msgpack_write_iovec(self.fd, &iov, 1)
+        if err != 0:
+            raise OSError(err, strerror(err))
+        self.flushed += self.pk.length
+        self.pk.length = 0
+        return 0
+
+    def append(self, object obj):
+        """Pack obj as the next item of the list."""
+        cdef int ret
+        if self.fd < 0:
+            raise ValueError("FileListEncoder is closed")
+        self.packer._acquire()
+        try:
+            ret = msgpack_encode(&self.packer.enc, &self.pk, obj)
+            if ret != 0:
+                raise_encode_error(&self.packer.enc, ret)
+        finally:
+            self.packer.busy = False
+        self.count += 1
+        if self.pk.length >= self.flush_size:
+            self._flush()
+
+    def extend(self, object objs):
+        """Append every item of the iterable objs."""
+        for obj in objs:
+            self.append(obj)
+
+    def finish(self):
+        """
+        Write the list to `path` and remove the scratch file. Returns the
+        size of the list.
+        """
+        cdef int out
+        cdef int err
+        if self.fd < 0:
+            raise ValueError("FileListEncoder is closed")
+        try:
+            self._flush()
+            os.lseek(self.fd, 0, os.SEEK_SET)
+            out = os.open(self.path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC | getattr(os, 'O_BINARY', 0),
+                          0o666)
+            try:
+                with nogil:
+                    err = msgpack_file_list_finish(self.fd, out, self.flushed)
+                if err != 0:
+                    raise OSError(err, strerror(err))
+                size = os.lseek(out, 0, os.SEEK_CUR)
+            finally:
+                os.close(out)
+        finally:
+            self.abort()
+        return size
+
+    def abort(self):
+        """Discard the list and remove the scratch file."""
+        if self.fd < 0:
+            return
+        os.close(self.fd)
+        self.fd = -1
+        os.unlink(self.scratch_path)
+        msgpack_arena_release(self.pk.buf, self.pk.buf_size)
+        self.pk.buf = NULL
+        self.pk.buf_size = 0
+        self.pk.length = 0
+
+
+# Packers of the calls with default options, one per thread. Packing runs
+# Python code (generators, iterables, __rlp_fields__ attributes, finalizers)
+# that may switch threads or call packb again, so a thread whose Packer is
+# still packing gets a fresh one instead.
+cdef object default_packers = threading.local()
+
+cdef Packer default_packer():
+    cdef Packer packer = getattr(default_packers, 'packer', None)
+    if packer is None:
+        packer = Packer()
+        default_packers.packer = packer
+    elif packer.busy:
+        return Packer()
+    return packer
+
+
+def packb(object o, **kwargs):
+    """
+    Pack object `o` and return packed bytes
+
+    See :class:`Packer` for options.
+    """
+    return (Packer(**kwargs) if kwargs else default_packer()).pack(o)
+
+
+def pack_and_hash(object o, bint digest_only=False, **kwargs):
+    """
+    Return ``(packb(o), keccak(packb(o)))``, or only the digest with
+    digest_only, hashing while packing.
+
+    See :meth:`Packer.pack_and_hash`.
+    """
+    return (Packer(**kwargs) if kwargs else default_packer()).pack_and_hash(o, digest_only)
+
+
+def encoded_length(object o, **kwargs):
+    """
+    Return ``len(packb(o, **kwargs))`` without producing the packed bytes.
+
+    Like packing, this calls default() and consumes iterators in `o`. See
+    :meth:`Packer.encoded_length`.
+    """
+    return (Packer(**kwargs) if kwargs else default_packer()).encoded_length(o)
@@ -4,6 +4,9 @@
 from cpython.version cimport PY_MAJOR_VERSION
 from cpython.bytes cimport (
     PyBytes_AsString,
+    PyBytes_AS_STRING,
+    PyBytes_GET_SIZE,
+    PyBytes_CheckExact,
     PyBytes_FromStringAndSize,
     PyBytes_Size,
 )
@@ -124,6 +127,18 @@ cdef inline init_ctx(unpack_context *ctx, object sedes,
     ctx.user.encoding = encoding
     ctx.user.unicode_errors = unicode_errors
 
+# unpack_user for the default options of unpackb, set up once at import
+cdef msgpack_user default_user
+
+cdef init_default_user():
+    global default_user
+    cdef unpack_context ctx
+    init_ctx(&ctx, None, None, None, None, ExtType, False, True, NULL, NULL,
+             2147483647, 2147483647, 2147483647, 2147483647, 2147483647)
+    default_user = ctx.user
+
+init_default_user()
+
 def default_read_extended_type(typecode, data):
     raise NotImplementedError("Cannot decode extended type with typecode=%d" % typecode)
 
@@ -197,11 +212,25 @@ def unpackb(object packed, object object_hook=None, object list_hook=None,
     if unicode_errors is not None:
         cerr = unicode_errors
 
-    get_data_from_buffer(packed, &view, &buf, &buf_len, &new_protocol)
+    if PyBytes_CheckExact(packed):
+        # bytes are immutable, no need to go through the buffer protocol
+        buf = PyBytes_AS_STRING(packed)
+        buf_len = PyBytes_GET_SIZE(packed)
+    else:
+        get_data_from_buffer(packed, &view, &buf, &buf_len, &new_protocol)
     try:
-        init_ctx(&ctx, sedes, object_hook, object_pairs_hook, list_hook, ext_hook,
-                 use_list, raw, cenc, cerr,
-                 max_str_len, max_bin_len, max_array_len, max_map_len, max_ext_len)
+        if (sedes is None and object_hook is None and list_hook is None and
+                object_pairs_hook is None and ext_hook is ExtType and
+                not use_list and raw and cenc == NULL and cerr == NULL and
+                max_str_len == 2147483647 and max_bin_len == 2147483647 and
+                max_array_len == 2147483647 and max_map_len == 2147483647 and
+                max_ext_len == 2147483647):
+            ctx.user = default_user
+            unpack_init(&ctx)
+        else:
+            init_ctx(&ctx, sedes, object_hook, object_pairs_hook, list_hook, ext_hook,
+                     use_list, raw, cenc, cerr,
+                     max_str_len, max_bin_len, max_array_len, max_map_len, max_ext_len)
         ret = unpack_construct(&ctx, buf, buf_len, &off)
     finally:
         if new_protocol:
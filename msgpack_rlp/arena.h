@@ -0,0 +1,156 @@
+/*
+ * Process wide arena of packer buffers
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_ARENA_H__
+#define MSGPACK_ARENA_H__
+
+#include "sysdep.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Buffers come in power of two size classes from 4 KiB to 64 MiB. Released
+// buffers are kept on a small free list per class, as long as the arena holds
+// no more than high_water bytes in total; anything else goes back to the
+// allocator. Buffers above the largest class are never cached.
+//
+// All access happens with the GIL held, which is what serializes it.
+//
+#define MSGPACK_ARENA_MIN_SHIFT 12
+#define MSGPACK_ARENA_CLASSES 15
+#define MSGPACK_ARENA_DEPTH 8
+#define MSGPACK_ARENA_HIGH_WATER ((size_t)64 * 1024 * 1024)
+#define MSGPACK_ARENA_TRIM_SIZE ((size_t)1024 * 1024)
+
+typedef struct msgpack_arena {
+    size_t high_water;  // most bytes kept on the free lists
+    size_t trim_size;   // empty packer buffers larger than this are given back
+
+    char* free_list[MSGPACK_ARENA_CLASSES][MSGPACK_ARENA_DEPTH];
+    size_t free_count[MSGPACK_ARENA_CLASSES];
+
+    size_t cached_bytes;
+    size_t peak_cached_bytes;
+    size_t hits;        // acquires served from a free list
+    size_t misses;      // acquires that had to allocate
+    size_t releases;
+    size_t evictions;   // released buffers freed instead of cached
+    size_t trims;       // oversized packer buffers given back after a spike
+} msgpack_arena;
+
+static msgpack_arena msgpack_buffer_arena = {
+    MSGPACK_ARENA_HIGH_WATER, MSGPACK_ARENA_TRIM_SIZE,
+    {{NULL}}, {0},
+    0, 0, 0, 0, 0, 0, 0,
+};
+
+//
+// size class holding n bytes, or -1 when n is above the largest class
+//
+static inline int msgpack_arena_class(size_t n)
+{
+    unsigned int bits;
+    if (n <= ((size_t)1 << MSGPACK_ARENA_MIN_SHIFT))
+        return 0;
+    bits = 64 - _msgpack_clz64((uint64_t)(n - 1));
+    if (bits - MSGPACK_ARENA_MIN_SHIFT >= MSGPACK_ARENA_CLASSES)
+        return -1;
+    return (int)(bits - MSGPACK_ARENA_MIN_SHIFT);
+}
+
+static inline size_t msgpack_arena_class_size(int c)
+{
+    return (size_t)1 << (c + MSGPACK_ARENA_MIN_SHIFT);
+}
+
+//
+// returns a buffer of at least n bytes and stores its real size in *size.
+// NULL when out of memory; no exception is set.
+//
+static inline char* msgpack_arena_acquire(size_t n, size_t* size)
+{
+    msgpack_arena* a = &msgpack_buffer_arena;
+    int c = msgpack_arena_class(n);
+    char* buf;
+
+    if (c < 0) {
+        a->misses++;
+        *size = n;
+        return (char*)PyMem_Malloc(n);
+    }
+    *size = msgpack_arena_class_size(c);
+    if (a->free_count[c]) {
+        a->hits++;
+        a->cached_bytes -= *size;
+        return a->free_list[c][--a->free_count[c]];
+    }
+    a->misses++;
+    buf = (char*)PyMem_Malloc(*size);
+    return buf;
+}
+
+static inline void msgpack_arena_release(char* buf, size_t size)
+{
+    msgpack_arena* a = &msgpack_buffer_arena;
+    int c;
+
+    if (!buf)
+        return;
+    a->releases++;
+    c = msgpack_arena_class(size);
+    if (c >= 0 && msgpack_arena_class_size(c) == size
+            && a->free_count[c] < MSGPACK_ARENA_DEPTH
+            && a->cached_bytes + size <= a->high_water) {
+        a->free_list[c][a->free_count[c]++] = buf;
+        a->cached_bytes += size;
+        if (a->cached_bytes > a->peak_cached_bytes)
+            a->peak_cached_bytes = a->cached_bytes;
+        return;
+    }
+    a->evictions++;
+    PyMem_Free(buf);
+}
+
+//
+// frees cached buffers, largest first, until at most limit bytes are kept
+//
+static inline void msgpack_arena_shrink(size_t limit)
+{
+    msgpack_arena* a = &msgpack_buffer_arena;
+    int c;
+
+    for (c = MSGPACK_ARENA_CLASSES - 1; c >= 0 && a->cached_bytes > limit; c--) {
+        while (a->free_count[c] && a->cached_bytes > limit) {
+            PyMem_Free(a->free_list[c][--a->free_count[c]]);
+            a->cached_bytes -= msgpack_arena_class_size(c);
+            a->evictions++;
+        }
+    }
+}
+
+static inline void msgpack_arena_configure(size_t high_water, size_t trim_size)
+{
+    msgpack_buffer_arena.high_water = high_water;
+    msgpack_buffer_arena.trim_size = trim_size;
+    msgpack_arena_shrink(high_water);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* msgpack/arena.h */
@@ -0,0 +1,174 @@
+/*
+ * Batch encoding on worker threads
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_BATCH_H__
+#define MSGPACK_BATCH_H__
+
+#include <system_error>
+#include <thread>
+#include <vector>
+#include "pack.h"
+
+//
+// Packer.pack_batch snapshots every object with the GIL held (the sizing
+// pass with enc->ir set), which yields the exact output offset of each item.
+// The result is then written with the GIL released: the items are split into
+// runs of about equal byte size and each worker writes its run through its
+// own fixed msgpack_packer, straight into the result bytes object.
+//
+
+// runs smaller than this are not worth a thread
+#define MSGPACK_BATCH_MIN_RUN ((size_t)64 * 1024)
+
+typedef struct msgpack_batch {
+    msgpack_ir ir;
+    Py_ssize_t count;
+    size_t *bounds;     // tokens of item i are [bounds[i], bounds[i + 1])
+    size_t *starts;     // output of item i is [starts[i], starts[i + 1])
+} msgpack_batch;
+
+static inline void msgpack_batch_init(msgpack_batch* b)
+{
+    memset(b, 0, sizeof(msgpack_batch));
+    msgpack_ir_init(&b->ir);
+}
+
+static inline void msgpack_batch_free(msgpack_batch* b)
+{
+    msgpack_ir_free(&b->ir);
+    PyMem_Free(b->bounds);
+    PyMem_Free(b->starts);
+    msgpack_batch_init(b);
+}
+
+//
+// sizes and snapshots the items of seq, a list or tuple. The plan of enc
+// holds the list sizes of the whole batch until the next encode. Buffer
+// objects are copied unless borrow_buffers is set (see msgpack_ir).
+//
+static inline int msgpack_batch_snapshot(msgpack_encoder* enc, msgpack_batch* b, PyObject* seq,
+                                         bool borrow_buffers)
+{
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    Py_ssize_t i;
+    size_t size;
+    int ret = 0;
+
+    b->bounds = (size_t*)PyMem_Malloc((n + 1) * sizeof(size_t));
+    b->starts = (size_t*)PyMem_Malloc((n + 1) * sizeof(size_t));
+    if (!b->bounds || !b->starts) {
+        PyErr_NoMemory();
+        return MSGPACK_ENCODE_ERROR;
+    }
+    b->count = n;
+    b->starts[0] = 0;
+    b->ir.borrow_buffers = borrow_buffers;
+
+    msgpack_encoder_reset(enc);
+    enc->ir = &b->ir;
+    for (i = 0; i < n && ret == 0; i++) {
+        b->bounds[i] = b->ir.length;
+        ret = msgpack_encode_size(enc, PySequence_Fast_GET_ITEM(seq, i), &size);
+        b->starts[i + 1] = b->starts[i] + size;
+    }
+    enc->ir = NULL;
+    b->bounds[n] = b->ir.length;
+    if (ret == 0)
+        msgpack_ir_finish(&b->ir);
+    return ret;
+}
+
+// writes items [lo, hi) at their place in out
+static inline bool msgpack_batch_write_run(const msgpack_encoder* enc, const msgpack_batch* b,
+                                           char* out, Py_ssize_t lo, Py_ssize_t hi)
+{
+    msgpack_packer pk;
+    size_t size = b->starts[hi] - b->starts[lo];
+
+    // the snapshot holds copies of everything mutable and is sized exactly, so
+    // the fixed buffer can't overflow and nothing here needs the GIL
+    memset(&pk, 0, sizeof(pk));
+    pk.buf = out + b->starts[lo];
+    pk.buf_size = size;
+    pk.fixed = true;
+    if (msgpack_ir_write(&b->ir, enc->plan.sizes, b->bounds[lo], b->bounds[hi], &pk))
+        return false;
+    return pk.length == size;
+}
+
+//
+// writes the whole snapshot into out, on up to threads threads (0 means one
+// per core). Called without the GIL.
+//
+static inline bool msgpack_batch_write(const msgpack_encoder* enc, const msgpack_batch* b,
+                                       char* out, size_t threads)
+{
+    size_t total = b->starts[b->count];
+    std::vector<Py_ssize_t> cuts;
+    std::vector<std::thread> workers;
+    std::vector<char> ok;
+    size_t runs, k;
+    Py_ssize_t i = 0;
+
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    runs = total / MSGPACK_BATCH_MIN_RUN + 1;
+    if (runs > threads)
+        runs = threads;
+    if (runs > (size_t)b->count)
+        runs = b->count;
+    if (runs <= 1)
+        return msgpack_batch_write_run(enc, b, out, 0, b->count);
+
+    try {
+        // cut before the first item starting past each k/runs of the output
+        cuts.push_back(0);
+        for (k = 1; k < runs; k++) {
+            while (i < b->count && b->starts[i] < total / runs * k)
+                i++;
+            if (i > cuts.back() && i < b->count)
+                cuts.push_back(i);
+        }
+        cuts.push_back(b->count);
+        ok.assign(cuts.size() - 1, 0);
+
+        for (k = 1; k + 1 < cuts.size(); k++) {
+            Py_ssize_t lo = cuts[k], hi = cuts[k + 1];
+            char* result = &ok[k];
+            try {
+                workers.push_back(std::thread([=]() {
+                    *result = msgpack_batch_write_run(enc, b, out, lo, hi);
+                }));
+            } catch (const std::system_error&) {
+                // no more threads, this run is written here
+                *result = msgpack_batch_write_run(enc, b, out, lo, hi);
+            }
+        }
+    } catch (...) {
+        for (k = 0; k < workers.size(); k++)
+            workers[k].join();
+        return false;
+    }
+    ok[0] = msgpack_batch_write_run(enc, b, out, cuts[0], cuts[1]);
+    for (k = 0; k < workers.size(); k++)
+        workers[k].join();
+    for (k = 0; k < ok.size(); k++) {
+        if (!ok[k])
+            return false;
+    }
+    return true;
+}
+
+#endif /* msgpack/batch.h */
@@ -0,0 +1,365 @@
+/*
+ * Records packed from columns
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_COLUMNS_H__
+#define MSGPACK_COLUMNS_H__
+
+#include "pack.h"
+
+//
+// Packer.pack_columns packs N columns of equal length as the list of their
+// rows, each row a list of N items, without making the rows as Python
+// objects. A column is a sequence of objects, packed as usual, or a typed
+// buffer read in place: a one dimensional buffer of unsigned ints (as for
+// array('Q')) is a column of integers and a two dimensional buffer of bytes
+// of shape (rows, width), or one of a fixed size bytes format, a column of
+// strings of width bytes. Any other buffer is a sequence of its items.
+//
+// The passes are those of msgpack_encode. The plan gets the payload size of
+// the whole list first, then for each row the size of the row followed by
+// the slots of its items.
+//
+typedef enum {
+    MSGPACK_COLUMN_OBJECTS,
+    MSGPACK_COLUMN_UINT,
+    MSGPACK_COLUMN_BYTES,
+} msgpack_column_kind;
+
+typedef struct msgpack_column {
+    msgpack_column_kind kind;
+    PyObject *seq;          // OBJECTS: list or tuple of the items
+    Py_buffer view;         // UINT and BYTES
+    unsigned int width;     // UINT: bytes per item, BYTES: bytes per row
+    bool swap;              // UINT: items are byte swapped
+    size_t sede;            // sedes node of the items, when packed by sedes
+} msgpack_column;
+
+typedef struct msgpack_columns {
+    PyObject *seq;
+    msgpack_column *items;
+    size_t count;           // opened so far
+    Py_ssize_t rows;
+} msgpack_columns;
+
+static inline void msgpack_columns_init(msgpack_columns* c)
+{
+    memset(c, 0, sizeof(msgpack_columns));
+}
+
+static inline void msgpack_columns_free(msgpack_columns* c)
+{
+    size_t j;
+    for (j = 0; j < c->count; j++) {
+        if (c->items[j].kind == MSGPACK_COLUMN_OBJECTS)
+            Py_DECREF(c->items[j].seq);
+        else
+            PyBuffer_Release(&c->items[j].view);
+    }
+    PyMem_Free(c->items);
+    Py_XDECREF(c->seq);
+    msgpack_columns_init(c);
+}
+
+static inline int msgpack_column_open_objects(msgpack_column* k, PyObject* column,
+                                               Py_ssize_t* rows)
+{
+    k->seq = PySequence_Fast(column, "columns must be sequences or typed buffers");
+    if (k->seq == NULL)
+        return -1;
+    k->kind = MSGPACK_COLUMN_OBJECTS;
+    *rows = PySequence_Fast_GET_SIZE(k->seq);
+    return 0;
+}
+
+static inline int msgpack_column_open(msgpack_column* k, PyObject* column, Py_ssize_t* rows)
+{
+    const Py_buffer* v = &k->view;
+    const char* f;
+
+    if (PyList_Check(column) || PyTuple_Check(column) || !PyObject_CheckBuffer(column))
+        return msgpack_column_open_objects(k, column, rows);
+
+    if (PyObject_GetBuffer(column, &k->view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return -1;
+    if (v->ndim == 1 && (k->width = msgpack_view_uint_width(v, &k->swap)) != 0) {
+        k->kind = MSGPACK_COLUMN_UINT;
+        *rows = v->len / v->itemsize;
+        return 0;
+    }
+    // rows of bytes, or items of a fixed size bytes format (numpy's S20);
+    // byte order means nothing to either
+    f = v->format ? v->format : "";
+    if (*f && strchr("@=<>!", *f))
+        f++;
+    if (v->ndim == 2 && v->itemsize == 1 && (strcmp(f, "B") == 0 || strcmp(f, "c") == 0)) {
+        k->kind = MSGPACK_COLUMN_BYTES;
+        k->width = (unsigned int)v->shape[1];
+        *rows = v->shape[0];
+        if ((Py_ssize_t)k->width == v->shape[1])
+            return 0;
+    } else if (v->ndim == 1 && *f && f[strlen(f) - 1] == 's') {
+        k->kind = MSGPACK_COLUMN_BYTES;
+        k->width = (unsigned int)v->itemsize;
+        *rows = v->shape[0];
+        if ((Py_ssize_t)k->width == v->itemsize)
+            return 0;
+    }
+    // any other buffer (array('B'), bytes, ...) is a sequence of its items
+    PyBuffer_Release(&k->view);
+    return msgpack_column_open_objects(k, column, rows);
+}
+
+//
+// the sedes of the items of each column, when the encoder packs by sedes:
+// that one has to describe a list of records of one field per column
+//
+static inline int msgpack_columns_sedes(msgpack_columns* c, const msgpack_sedes* s)
+{
+    const msgpack_sede* root = &s->nodes[0];
+    const msgpack_sede* record = NULL;
+    size_t j;
+
+    // items is only a node index for a REPEAT root
+    if (root->kind == MSGPACK_SEDE_REPEAT)
+        record = &s->nodes[root->items];
+    if (record == NULL || record->kind != MSGPACK_SEDE_RECORD || record->length != c->count) {
+        PyErr_Format(PyExc_ValueError, "the sedes must be a list of records of %zu fields",
+                     c->count);
+        return -1;
+    }
+    for (j = 0; j < c->count; j++) {
+        msgpack_column* k = &c->items[j];
+        const msgpack_sede* d;
+        bool ok;
+
+        k->sede = s->children[record->items + j];
+        d = &s->nodes[k->sede];
+        switch (k->kind) {
+        case MSGPACK_COLUMN_UINT:
+            ok = d->kind == MSGPACK_SEDE_UINT && d->length >= k->width;
+            break;
+        case MSGPACK_COLUMN_BYTES:
+            ok = d->kind == MSGPACK_SEDE_BYTES ||
+                (d->kind == MSGPACK_SEDE_FIXED && d->length == k->width);
+            break;
+        default:
+            ok = true;  // item by item
+            break;
+        }
+        if (!ok) {
+            PyErr_Format(PyExc_ValueError, "column %zu doesn't match the sedes", j);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// -1 with an exception when a column can't be used
+static inline int msgpack_columns_open(msgpack_columns* c, const msgpack_encoder* enc,
+                                       PyObject* columns)
+{
+    Py_ssize_t n, rows;
+    size_t j;
+
+    c->seq = PySequence_Fast(columns, "columns must be a sequence");
+    if (c->seq == NULL)
+        return -1;
+    n = PySequence_Fast_GET_SIZE(c->seq);
+    if (n > 0) {
+        c->items = (msgpack_column*)PyMem_Malloc(n * sizeof(msgpack_column));
+        if (!c->items) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    for (j = 0; j < (size_t)n; j++) {
+        memset(&c->items[j], 0, sizeof(msgpack_column));
+        if (msgpack_column_open(&c->items[j], PySequence_Fast_GET_ITEM(c->seq, j), &rows))
+            return -1;
+        c->count++;
+        if (j == 0) {
+            c->rows = rows;
+        } else if (rows != c->rows) {
+            PyErr_SetString(PyExc_ValueError, "columns must have the same length");
+            return -1;
+        }
+    }
+    return enc->sedes ? msgpack_columns_sedes(c, enc->sedes) : 0;
+}
+
+// item i of an object column, NULL when the column got shorter
+static inline PyObject* msgpack_column_item(const msgpack_column* k, Py_ssize_t i)
+{
+    if (i >= PySequence_Fast_GET_SIZE(k->seq))
+        return NULL;
+    return PySequence_Fast_GET_ITEM(k->seq, i);
+}
+
+static inline int msgpack_columns_size(msgpack_encoder* enc, const msgpack_columns* c,
+                                       size_t* total)
+{
+    size_t slot = msgpack_plan_push(&enc->plan);
+    size_t payload = 0, row_slot, row, size;
+    Py_ssize_t i;
+    size_t j;
+    int ret;
+
+    if (slot == (size_t)-1)
+        return MSGPACK_ENCODE_ERROR;
+    // the rows are at depth 1 and their items at depth 2
+    if (c->rows > 0 && enc->max_depth < (c->count ? 2 : 1))
+        return MSGPACK_ENCODE_DEPTH;
+    for (i = 0; i < c->rows; i++) {
+        row_slot = msgpack_plan_push(&enc->plan);
+        if (row_slot == (size_t)-1)
+            return MSGPACK_ENCODE_ERROR;
+        row = 0;
+        for (j = 0; j < c->count; j++) {
+            const msgpack_column* k = &c->items[j];
+            const char* p;
+            PyObject* o;
+
+            switch (k->kind) {
+            case MSGPACK_COLUMN_UINT:
+                p = (const char*)k->view.buf + i * k->width;
+                size = msgpack_pack_uint64_size(msgpack_uint_array_item(p, k->width, k->swap));
+                break;
+            case MSGPACK_COLUMN_BYTES:
+                p = (const char*)k->view.buf + i * k->width;
+                size = msgpack_pack_string_size(p, k->width);
+                break;
+            default:
+                // default() may shorten the column or drop the item
+                o = msgpack_column_item(k, i);
+                if (o == NULL)
+                    return MSGPACK_ENCODE_CHANGED;
+                Py_INCREF(o);
+                // sized as a root, with the depth budget left below depth 2
+                enc->max_depth -= 2;
+                ret = enc->sedes ? msgpack_sedes_size(enc, k->sede, o, &size)
+                                 : msgpack_encode_size(enc, o, &size);
+                enc->max_depth += 2;
+                Py_DECREF(o);
+                if (ret)
+                    return ret;
+                break;
+            }
+            row += size;
+        }
+        enc->plan.sizes[row_slot] = row;
+        payload += msgpack_pack_header_size(row) + row;
+    }
+    enc->plan.sizes[slot] = payload;
+    *total = msgpack_pack_header_size(payload) + payload;
+    return 0;
+}
+
+static inline int msgpack_columns_write(msgpack_encoder* enc, msgpack_packer* pk,
+                                        const msgpack_columns* c)
+{
+    size_t payload = msgpack_plan_next(&enc->plan);
+    size_t start, row, row_start;
+    Py_ssize_t i;
+    size_t j;
+    int ret;
+
+    if (payload == (size_t)-1)
+        return MSGPACK_ENCODE_CHANGED;
+    if (msgpack_pack_array(pk, payload))
+        return MSGPACK_ENCODE_ERROR;
+    start = msgpack_pack_position(pk);
+    for (i = 0; i < c->rows; i++) {
+        row = msgpack_plan_next(&enc->plan);
+        if (row == (size_t)-1)
+            return MSGPACK_ENCODE_CHANGED;
+        if (msgpack_pack_array(pk, row))
+            return MSGPACK_ENCODE_ERROR;
+        row_start = msgpack_pack_position(pk);
+        for (j = 0; j < c->count; j++) {
+            const msgpack_column* k = &c->items[j];
+            const char* p;
+            PyObject* o;
+
+            switch (k->kind) {
+            case MSGPACK_COLUMN_UINT:
+                p = (const char*)k->view.buf + i * k->width;
+                ret = msgpack_pack_uint(pk, msgpack_uint_array_item(p, k->width, k->swap));
+                break;
+            case MSGPACK_COLUMN_BYTES:
+                p = (const char*)k->view.buf + i * k->width;
+                ret = msgpack_pack_string(pk, p, k->width);
+                break;
+            default:
+                o = msgpack_column_item(k, i);
+                if (o == NULL)
+                    return MSGPACK_ENCODE_CHANGED;
+                ret = enc->sedes ? msgpack_sedes_write(enc, pk, k->sede, o)
+                                 : msgpack_encode_write(enc, pk, o);
+                break;
+            }
+            if (ret)
+                return ret;
+        }
+        if (msgpack_pack_position(pk) - row_start != row)
+            return MSGPACK_ENCODE_CHANGED;
+    }
+    if (msgpack_pack_position(pk) - start != payload)
+        return MSGPACK_ENCODE_CHANGED;
+    return 0;
+}
+
+//
+// packs the columns into a new bytes object of exactly the encoded size,
+// as msgpack_encode_bytes does for a single object
+//
+static inline int msgpack_encode_columns(msgpack_encoder* enc, const msgpack_columns* c,
+                                         PyObject** result)
+{
+    PyObject* res = NULL;
+    msgpack_packer pk;
+    size_t size;
+    int ret;
+
+    msgpack_encoder_reset(enc);
+    ret = msgpack_columns_size(enc, c, &size);
+    if (ret == 0) {
+        if (size > PY_SSIZE_T_MAX)
+            PyErr_NoMemory();
+        else
+            res = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)size);
+        if (!res)
+            ret = MSGPACK_ENCODE_ERROR;
+    }
+    if (ret == 0) {
+        memset(&pk, 0, sizeof(pk));
+        pk.buf = PyBytes_AS_STRING(res);
+        pk.buf_size = size;
+        pk.fixed = true;
+        ret = msgpack_columns_write(enc, &pk, c);
+        if (ret == MSGPACK_ENCODE_ERROR && pk.overflowed)
+            ret = MSGPACK_ENCODE_CHANGED;
+        if (ret == 0 && pk.length != size)
+            ret = MSGPACK_ENCODE_CHANGED;
+        if (ret == 0 && enc->memo)
+            msgpack_memo_commit(enc->memo, pk.buf);
+        if (ret)
+            Py_CLEAR(res);
+    }
+    msgpack_encoder_reset(enc);
+    *result = res;
+    return ret;
+}
+
+#endif /* msgpack/columns.h */
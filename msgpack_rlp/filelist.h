@@ -0,0 +1,142 @@
+/*
+ * Lists encoded through a file
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_FILELIST_H__
+#define MSGPACK_FILELIST_H__
+
+#include <stdlib.h>
+#include "segments.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+//
+// FileListEncoder streams the payload of a list too large for memory into a
+// scratch file next to the target. Once the payload size is known the target
+// gets the list prefix, then the payload is moved over with copy_file_range,
+// which stays in the kernel (or shares extents on filesystems with reflinks).
+// Systems without it fall back to a plain read/write loop.
+//
+
+// bytes per copy_file_range call and size of the fallback buffer
+#define MSGPACK_COPY_CHUNK ((size_t)1 << 30)
+#define MSGPACK_COPY_BUFFER ((size_t)1 << 20)
+
+//
+// copies size bytes from the position of in to the position of out. Returns 0
+// or an errno value. Called without the GIL.
+//
+static inline int msgpack_copy_fd(int in, int out, uint64_t size)
+{
+    msgpack_iovec iov;
+    char* buf;
+    int err = 0;
+
+#if defined(__linux__) && defined(__NR_copy_file_range)
+    while (size) {
+        size_t chunk = size > MSGPACK_COPY_CHUNK ? MSGPACK_COPY_CHUNK : (size_t)size;
+        Py_ssize_t n = syscall(__NR_copy_file_range, in, NULL, out, NULL, chunk, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // not across these files or filesystems, copy the rest below
+            if (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                    errno == EOPNOTSUPP || errno == EBADF)
+                break;
+            return errno;
+        }
+        if (n == 0)
+            return EIO;
+        size -= n;
+    }
+    if (size == 0)
+        return 0;
+#endif
+
+    buf = (char*)malloc(MSGPACK_COPY_BUFFER);
+    if (!buf)
+        return ENOMEM;
+    while (size && err == 0) {
+        size_t chunk = size > MSGPACK_COPY_BUFFER ? MSGPACK_COPY_BUFFER : (size_t)size;
+#ifdef _WIN32
+        Py_ssize_t n = _read(in, buf, (unsigned int)chunk);
+#else
+        Py_ssize_t n = read(in, buf, chunk);
+#endif
+        if (n < 0) {
+            if (errno != EINTR)
+                err = errno;
+            continue;
+        }
+        if (n == 0) {
+            err = EIO;
+            continue;
+        }
+        iov.iov_base = buf;
+        iov.iov_len = n;
+        err = msgpack_write_iovec(out, &iov, 1);
+        size -= n;
+    }
+    free(buf);
+    return err;
+}
+
+//
+// writes the prefix of a list with the payload bytes at the position of
+// scratch to out, followed by the payload itself. Returns 0 or an errno
+// value. Called without the GIL.
+//
+static inline int msgpack_file_list_finish(int scratch, int out, uint64_t payload)
+{
+    char header[MSGPACK_MAX_HEADER_SIZE];
+    msgpack_iovec iov;
+    msgpack_packer pk;
+    int err;
+
+    memset(&pk, 0, sizeof(pk));
+    pk.buf = header;
+    pk.buf_size = sizeof(header);
+    pk.fixed = true;
+    // the list prefix, with a 64 bit length even where size_t is smaller
+    msgpack_pack_prefix(&pk, 0xc0, payload);
+
+    iov.iov_base = header;
+    iov.iov_len = pk.length;
+    err = msgpack_write_iovec(out, &iov, 1);
+    if (err == 0)
+        err = msgpack_copy_fd(scratch, out, payload);
+    return err;
+}
+
+//
+// closes the scratch file and removes it, when the list is dropped without
+// being finished. path may be NULL. Errors are ignored, there is no one left
+// to report them to.
+//
+static inline void msgpack_file_list_discard(int scratch, const char* path)
+{
+#ifdef _WIN32
+    _close(scratch);
+    if (path)
+        _unlink(path);
+#else
+    close(scratch);
+    if (path)
+        unlink(path);
+#endif
+}
+
+#endif /* msgpack/filelist.h */
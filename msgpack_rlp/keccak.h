@@ -0,0 +1,241 @@
+/*
+ * Keccak-256 sponge
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_KECCAK_H__
+#define MSGPACK_KECCAK_H__
+
+#include <stddef.h>
+#include <string.h>
+#include "sysdep.h"
+
+//
+// The original Keccak-256 of Ethereum, which pads with 0x01 where the final
+// SHA3-256 pads with 0x06. Input can be absorbed in pieces of any size.
+//
+#define MSGPACK_KECCAK_RATE 136     // bytes per block, 1600 - 2 * 256 bits
+#define MSGPACK_KECCAK_DIGEST 32
+
+typedef struct msgpack_keccak {
+    uint64_t state[25];
+    unsigned char queue[MSGPACK_KECCAK_RATE];   // partial block
+    size_t queued;
+} msgpack_keccak;
+
+static const uint64_t msgpack_keccak_rc[24] = {
+    0x0000000000000001ull, 0x0000000000008082ull, 0x800000000000808aull,
+    0x8000000080008000ull, 0x000000000000808bull, 0x0000000080000001ull,
+    0x8000000080008081ull, 0x8000000000008009ull, 0x000000000000008aull,
+    0x0000000000000088ull, 0x0000000080008009ull, 0x000000008000000aull,
+    0x000000008000808bull, 0x800000000000008bull, 0x8000000000008089ull,
+    0x8000000000008003ull, 0x8000000000008002ull, 0x8000000000000080ull,
+    0x000000000000800aull, 0x800000008000000aull, 0x8000000080008081ull,
+    0x8000000000008080ull, 0x0000000080000001ull, 0x8000000080008008ull,
+};
+
+#define MSGPACK_KECCAK_ROTL(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+// keccak-f[1600], one round at a time on lanes kept in registers
+static inline void msgpack_keccak_permute(uint64_t* a)
+{
+    uint64_t a00, a01, a02, a03, a04, a05, a06, a07, a08, a09, a10, a11, a12,
+             a13, a14, a15, a16, a17, a18, a19, a20, a21, a22, a23, a24;
+    uint64_t b00, b01, b02, b03, b04, b05, b06, b07, b08, b09, b10, b11, b12,
+             b13, b14, b15, b16, b17, b18, b19, b20, b21, b22, b23, b24;
+    uint64_t c0, c1, c2, c3, c4, d0, d1, d2, d3, d4;
+    unsigned int round;
+
+    a00 = a[0];
+    a01 = a[1];
+    a02 = a[2];
+    a03 = a[3];
+    a04 = a[4];
+    a05 = a[5];
+    a06 = a[6];
+    a07 = a[7];
+    a08 = a[8];
+    a09 = a[9];
+    a10 = a[10];
+    a11 = a[11];
+    a12 = a[12];
+    a13 = a[13];
+    a14 = a[14];
+    a15 = a[15];
+    a16 = a[16];
+    a17 = a[17];
+    a18 = a[18];
+    a19 = a[19];
+    a20 = a[20];
+    a21 = a[21];
+    a22 = a[22];
+    a23 = a[23];
+    a24 = a[24];
+
+    for (round = 0; round < 24; round++) {
+        // theta
+        c0 = a00 ^ a05 ^ a10 ^ a15 ^ a20;
+        c1 = a01 ^ a06 ^ a11 ^ a16 ^ a21;
+        c2 = a02 ^ a07 ^ a12 ^ a17 ^ a22;
+        c3 = a03 ^ a08 ^ a13 ^ a18 ^ a23;
+        c4 = a04 ^ a09 ^ a14 ^ a19 ^ a24;
+        d0 = c4 ^ MSGPACK_KECCAK_ROTL(c1, 1);
+        d1 = c0 ^ MSGPACK_KECCAK_ROTL(c2, 1);
+        d2 = c1 ^ MSGPACK_KECCAK_ROTL(c3, 1);
+        d3 = c2 ^ MSGPACK_KECCAK_ROTL(c4, 1);
+        d4 = c3 ^ MSGPACK_KECCAK_ROTL(c0, 1);
+        // rho and pi
+        b00 = a00 ^ d0;
+        b10 = MSGPACK_KECCAK_ROTL(a01 ^ d1, 1);
+        b20 = MSGPACK_KECCAK_ROTL(a02 ^ d2, 62);
+        b05 = MSGPACK_KECCAK_ROTL(a03 ^ d3, 28);
+        b15 = MSGPACK_KECCAK_ROTL(a04 ^ d4, 27);
+        b16 = MSGPACK_KECCAK_ROTL(a05 ^ d0, 36);
+        b01 = MSGPACK_KECCAK_ROTL(a06 ^ d1, 44);
+        b11 = MSGPACK_KECCAK_ROTL(a07 ^ d2, 6);
+        b21 = MSGPACK_KECCAK_ROTL(a08 ^ d3, 55);
+        b06 = MSGPACK_KECCAK_ROTL(a09 ^ d4, 20);
+        b07 = MSGPACK_KECCAK_ROTL(a10 ^ d0, 3);
+        b17 = MSGPACK_KECCAK_ROTL(a11 ^ d1, 10);
+        b02 = MSGPACK_KECCAK_ROTL(a12 ^ d2, 43);
+        b12 = MSGPACK_KECCAK_ROTL(a13 ^ d3, 25);
+        b22 = MSGPACK_KECCAK_ROTL(a14 ^ d4, 39);
+        b23 = MSGPACK_KECCAK_ROTL(a15 ^ d0, 41);
+        b08 = MSGPACK_KECCAK_ROTL(a16 ^ d1, 45);
+        b18 = MSGPACK_KECCAK_ROTL(a17 ^ d2, 15);
+        b03 = MSGPACK_KECCAK_ROTL(a18 ^ d3, 21);
+        b13 = MSGPACK_KECCAK_ROTL(a19 ^ d4, 8);
+        b14 = MSGPACK_KECCAK_ROTL(a20 ^ d0, 18);
+        b24 = MSGPACK_KECCAK_ROTL(a21 ^ d1, 2);
+        b09 = MSGPACK_KECCAK_ROTL(a22 ^ d2, 61);
+        b19 = MSGPACK_KECCAK_ROTL(a23 ^ d3, 56);
+        b04 = MSGPACK_KECCAK_ROTL(a24 ^ d4, 14);
+        // chi and iota
+        a00 = b00 ^ (~b01 & b02);
+        a01 = b01 ^ (~b02 & b03);
+        a02 = b02 ^ (~b03 & b04);
+        a03 = b03 ^ (~b04 & b00);
+        a04 = b04 ^ (~b00 & b01);
+        a05 = b05 ^ (~b06 & b07);
+        a06 = b06 ^ (~b07 & b08);
+        a07 = b07 ^ (~b08 & b09);
+        a08 = b08 ^ (~b09 & b05);
+        a09 = b09 ^ (~b05 & b06);
+        a10 = b10 ^ (~b11 & b12);
+        a11 = b11 ^ (~b12 & b13);
+        a12 = b12 ^ (~b13 & b14);
+        a13 = b13 ^ (~b14 & b10);
+        a14 = b14 ^ (~b10 & b11);
+        a15 = b15 ^ (~b16 & b17);
+        a16 = b16 ^ (~b17 & b18);
+        a17 = b17 ^ (~b18 & b19);
+        a18 = b18 ^ (~b19 & b15);
+        a19 = b19 ^ (~b15 & b16);
+        a20 = b20 ^ (~b21 & b22);
+        a21 = b21 ^ (~b22 & b23);
+        a22 = b22 ^ (~b23 & b24);
+        a23 = b23 ^ (~b24 & b20);
+        a24 = b24 ^ (~b20 & b21);
+        a00 ^= msgpack_keccak_rc[round];
+    }
+
+    a[0] = a00;
+    a[1] = a01;
+    a[2] = a02;
+    a[3] = a03;
+    a[4] = a04;
+    a[5] = a05;
+    a[6] = a06;
+    a[7] = a07;
+    a[8] = a08;
+    a[9] = a09;
+    a[10] = a10;
+    a[11] = a11;
+    a[12] = a12;
+    a[13] = a13;
+    a[14] = a14;
+    a[15] = a15;
+    a[16] = a16;
+    a[17] = a17;
+    a[18] = a18;
+    a[19] = a19;
+    a[20] = a20;
+    a[21] = a21;
+    a[22] = a22;
+    a[23] = a23;
+    a[24] = a24;
+}
+
+static inline uint64_t msgpack_keccak_load(const unsigned char* p)
+{
+#ifdef __LITTLE_ENDIAN__
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+#else
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+        (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+        (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+#endif
+}
+
+static inline void msgpack_keccak_block(msgpack_keccak* k, const unsigned char* p)
+{
+    unsigned int i;
+    for (i = 0; i < MSGPACK_KECCAK_RATE / 8; i++)
+        k->state[i] ^= msgpack_keccak_load(p + 8 * i);
+    msgpack_keccak_permute(k->state);
+}
+
+static inline void msgpack_keccak_init(msgpack_keccak* k)
+{
+    memset(k, 0, sizeof(msgpack_keccak));
+}
+
+static inline void msgpack_keccak_absorb(msgpack_keccak* k, const char* data, size_t n)
+{
+    const unsigned char* p = (const unsigned char*)data;
+
+    if (k->queued) {
+        size_t take = MSGPACK_KECCAK_RATE - k->queued;
+        if (take > n)
+            take = n;
+        memcpy(k->queue + k->queued, p, take);
+        k->queued += take;
+        p += take;
+        n -= take;
+        if (k->queued < MSGPACK_KECCAK_RATE)
+            return;
+        msgpack_keccak_block(k, k->queue);
+        k->queued = 0;
+    }
+    // whole blocks straight from the input
+    for (; n >= MSGPACK_KECCAK_RATE; n -= MSGPACK_KECCAK_RATE, p += MSGPACK_KECCAK_RATE)
+        msgpack_keccak_block(k, p);
+    memcpy(k->queue, p, n);
+    k->queued = n;
+}
+
+static inline void msgpack_keccak_final(msgpack_keccak* k, unsigned char* digest)
+{
+    unsigned int i;
+
+    memset(k->queue + k->queued, 0, MSGPACK_KECCAK_RATE - k->queued);
+    k->queue[k->queued] ^= 0x01;
+    k->queue[MSGPACK_KECCAK_RATE - 1] ^= 0x80;
+    msgpack_keccak_block(k, k->queue);
+    for (i = 0; i < MSGPACK_KECCAK_DIGEST; i++)
+        digest[i] = (unsigned char)(k->state[i / 8] >> (8 * (i % 8)));
+}
+
+#endif /* msgpack/keccak.h */
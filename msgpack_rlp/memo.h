@@ -0,0 +1,405 @@
+/*
+ * Encoding memo
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_MEMO_H__
+#define MSGPACK_MEMO_H__
+
+#include "sysdep.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// A Packer created with memoize=True keeps two levels of memo:
+//
+//  - within a call, every list, tuple and registered object is remembered by
+//    identity once it is done, and each later occurrence of the same object
+//    is emitted by copying the bytes of the first one;
+//  - across calls, a bounded LRU maps tuples made only of bytes, ints, str,
+//    None and such tuples (the values whose equality implies an equal
+//    encoding) to their encoded image.
+//
+// The sizing pass makes every decision and marks it in the plan (see
+// MSGPACK_PLAN_SHARED and MSGPACK_PLAN_CACHED in pack.h), so the writing
+// pass only follows it.
+//
+#if PY_MAJOR_VERSION < 3
+typedef long Py_hash_t;
+#endif
+
+#define MSGPACK_MEMO_NONE ((size_t)-1)
+#define MSGPACK_MEMO_CAPACITY 1024
+#define MSGPACK_MEMO_MAX_IMAGE ((size_t)1024 * 1024)   // larger images aren't kept
+#define MSGPACK_MEMO_KEY_DEPTH 8        // deepest tuple nesting used as a key
+#define MSGPACK_MEMO_TABLE_KEEP 4096    // identity tables larger than this are freed
+
+// an object met during one call, by identity
+typedef struct msgpack_memo_entry {
+    PyObject *key;
+    size_t begin;       // first snapshot token (sizing) or output position (writing)
+    size_t end;         // token after the last one (sizing)
+    size_t size;        // encoded size
+} msgpack_memo_entry;
+
+typedef struct msgpack_memo_table {
+    msgpack_memo_entry *entries;    // open addressing, buf_size is a power of two
+    size_t length;
+    size_t buf_size;
+} msgpack_memo_table;
+
+// a tuple the sizing pass missed in the cache, added once it is written
+typedef struct msgpack_memo_pending {
+    PyObject *key;
+    Py_hash_t hash;
+} msgpack_memo_pending;
+
+typedef struct msgpack_memo_node {
+    PyObject *key;      // owned
+    PyObject *image;    // owned bytes
+    Py_hash_t hash;
+    size_t chain;       // next node of the same bucket
+    size_t newer;
+    size_t older;
+} msgpack_memo_node;
+
+typedef struct msgpack_memo_cache {
+    msgpack_memo_node *nodes;
+    size_t *buckets;
+    size_t mask;        // bucket count - 1
+    size_t capacity;
+    size_t length;
+    size_t newest;
+    size_t oldest;
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} msgpack_memo_cache;
+
+typedef struct msgpack_memo {
+    msgpack_memo_table sized;       // owns its keys
+    msgpack_memo_table written;     // borrows them
+    msgpack_memo_pending *pending;
+    size_t pending_length;
+    size_t pending_buf_size;
+    msgpack_memo_cache cache;
+    size_t shared;      // occurrences copied from earlier in the same call
+} msgpack_memo;
+
+
+/* identity tables */
+
+static inline size_t msgpack_memo_probe(const msgpack_memo_table* t, PyObject* key)
+{
+    size_t mask = t->buf_size - 1;
+    size_t i = (size_t)(((uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    while (t->entries[i].key != NULL && t->entries[i].key != key)
+        i = (i + 1) & mask;
+    return i;
+}
+
+static inline const msgpack_memo_entry* msgpack_memo_find(const msgpack_memo_table* t, PyObject* key)
+{
+    size_t i;
+    if (t->length == 0)
+        return NULL;
+    i = msgpack_memo_probe(t, key);
+    return t->entries[i].key ? &t->entries[i] : NULL;
+}
+
+// entry of key, added if missing. NULL with an exception set when out of memory
+static inline msgpack_memo_entry* msgpack_memo_insert(msgpack_memo_table* t, PyObject* key, bool own)
+{
+    size_t i;
+
+    if ((t->length + 1) * 4 > t->buf_size * 3) {
+        msgpack_memo_table grown;
+        grown.buf_size = t->buf_size ? t->buf_size * 2 : 64;
+        grown.length = t->length;
+        grown.entries = (msgpack_memo_entry*)PyMem_Malloc(grown.buf_size * sizeof(msgpack_memo_entry));
+        if (!grown.entries) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        memset(grown.entries, 0, grown.buf_size * sizeof(msgpack_memo_entry));
+        for (i = 0; i < t->buf_size; i++) {
+            if (t->entries[i].key)
+                grown.entries[msgpack_memo_probe(&grown, t->entries[i].key)] = t->entries[i];
+        }
+        PyMem_Free(t->entries);
+        *t = grown;
+    }
+    i = msgpack_memo_probe(t, key);
+    if (t->entries[i].key == NULL) {
+        if (own)
+            Py_INCREF(key);
+        t->entries[i].key = key;
+        t->length++;
+    }
+    return &t->entries[i];
+}
+
+static inline void msgpack_memo_table_clear(msgpack_memo_table* t, bool own)
+{
+    size_t i;
+
+    if (t->length == 0)
+        return;
+    if (own) {
+        for (i = 0; i < t->buf_size; i++)
+            Py_XDECREF(t->entries[i].key);
+    }
+    if (t->buf_size > MSGPACK_MEMO_TABLE_KEEP) {
+        // don't keep clearing the table of one huge call
+        PyMem_Free(t->entries);
+        t->entries = NULL;
+        t->buf_size = 0;
+    } else {
+        memset(t->entries, 0, t->buf_size * sizeof(msgpack_memo_entry));
+    }
+    t->length = 0;
+}
+
+
+/* cross-call cache */
+
+//
+// whether o can be a cache key: a tuple whose items are all exact bytes,
+// ints, str, None or such tuples. Equality of these implies equal encodings,
+// which isn't so for subclasses (RLPRaw == bytes) or bools and floats.
+//
+static inline bool msgpack_memo_cacheable(PyObject* o, int depth)
+{
+    Py_ssize_t i, n = PyTuple_GET_SIZE(o);
+
+    if (depth >= MSGPACK_MEMO_KEY_DEPTH || n == 0)
+        return false;
+    for (i = 0; i < n; i++) {
+        PyObject* item = PyTuple_GET_ITEM(o, i);
+        PyTypeObject* t = Py_TYPE(item);
+        if (t == &PyBytes_Type || t == &PyLong_Type || t == &PyUnicode_Type || item == Py_None)
+            continue;
+        if (t != &PyTuple_Type || !msgpack_memo_cacheable(item, depth + 1))
+            return false;
+    }
+    return true;
+}
+
+static inline void msgpack_memo_unlink(msgpack_memo_cache* c, size_t i)
+{
+    msgpack_memo_node* n = &c->nodes[i];
+    if (n->newer != MSGPACK_MEMO_NONE)
+        c->nodes[n->newer].older = n->older;
+    else
+        c->newest = n->older;
+    if (n->older != MSGPACK_MEMO_NONE)
+        c->nodes[n->older].newer = n->newer;
+    else
+        c->oldest = n->newer;
+}
+
+static inline void msgpack_memo_link_newest(msgpack_memo_cache* c, size_t i)
+{
+    msgpack_memo_node* n = &c->nodes[i];
+    n->newer = MSGPACK_MEMO_NONE;
+    n->older = c->newest;
+    if (c->newest != MSGPACK_MEMO_NONE)
+        c->nodes[c->newest].newer = i;
+    else
+        c->oldest = i;
+    c->newest = i;
+}
+
+//
+// looks up a cacheable key. Returns 1 and a borrowed *image on a hit, 0 on a
+// miss and -1 with an exception set on error.
+//
+static inline int msgpack_memo_cache_find(msgpack_memo_cache* c, PyObject* key, Py_hash_t hash,
+                                          PyObject** image)
+{
+    size_t i;
+
+    for (i = c->buckets[(size_t)hash & c->mask]; i != MSGPACK_MEMO_NONE; i = c->nodes[i].chain) {
+        msgpack_memo_node* n = &c->nodes[i];
+        if (n->hash != hash)
+            continue;
+        if (n->key != key) {
+            int eq = PyObject_RichCompareBool(n->key, key, Py_EQ);
+            if (eq < 0)
+                return -1;
+            if (!eq)
+                continue;
+        }
+        if (c->newest != i) {
+            msgpack_memo_unlink(c, i);
+            msgpack_memo_link_newest(c, i);
+        }
+        *image = n->image;
+        return 1;
+    }
+    return 0;
+}
+
+// adds key unless it is there already, evicting the least recently used
+static inline int msgpack_memo_cache_insert(msgpack_memo_cache* c, PyObject* key, Py_hash_t hash,
+                                            PyObject* image)
+{
+    PyObject* found;
+    size_t i, *p;
+    int ret;
+
+    if (c->capacity == 0)
+        return 0;
+    ret = msgpack_memo_cache_find(c, key, hash, &found);
+    if (ret != 0)
+        return ret < 0 ? -1 : 0;
+    if (c->length < c->capacity) {
+        i = c->length++;
+    } else {
+        i = c->oldest;
+        msgpack_memo_unlink(c, i);
+        for (p = &c->buckets[(size_t)c->nodes[i].hash & c->mask]; *p != i; p = &c->nodes[*p].chain)
+            ;
+        *p = c->nodes[i].chain;
+        Py_DECREF(c->nodes[i].key);
+        Py_DECREF(c->nodes[i].image);
+        c->evictions++;
+    }
+    Py_INCREF(key);
+    Py_INCREF(image);
+    c->nodes[i].key = key;
+    c->nodes[i].image = image;
+    c->nodes[i].hash = hash;
+    c->nodes[i].chain = c->buckets[(size_t)hash & c->mask];
+    c->buckets[(size_t)hash & c->mask] = i;
+    msgpack_memo_link_newest(c, i);
+    return 0;
+}
+
+static inline void msgpack_memo_cache_clear(msgpack_memo_cache* c)
+{
+    size_t i;
+    for (i = 0; i < c->length; i++) {
+        Py_DECREF(c->nodes[i].key);
+        Py_DECREF(c->nodes[i].image);
+    }
+    for (i = 0; i <= c->mask; i++)
+        c->buckets[i] = MSGPACK_MEMO_NONE;
+    c->length = 0;
+    c->newest = MSGPACK_MEMO_NONE;
+    c->oldest = MSGPACK_MEMO_NONE;
+}
+
+
+/* the memo */
+
+// a memo keeping up to capacity tuples across calls. NULL when out of memory
+static inline msgpack_memo* msgpack_memo_new(size_t capacity)
+{
+    msgpack_memo* memo = (msgpack_memo*)PyMem_Malloc(sizeof(msgpack_memo));
+    msgpack_memo_cache* c;
+    size_t buckets = 1;
+
+    if (!memo)
+        return (msgpack_memo*)PyErr_NoMemory();
+    memset(memo, 0, sizeof(msgpack_memo));
+    c = &memo->cache;
+    while (buckets < capacity)
+        buckets *= 2;
+    c->capacity = capacity;
+    c->mask = buckets - 1;
+    c->buckets = (size_t*)PyMem_Malloc(buckets * sizeof(size_t));
+    c->nodes = (msgpack_memo_node*)PyMem_Malloc((capacity ? capacity : 1) * sizeof(msgpack_memo_node));
+    if (!c->buckets || !c->nodes) {
+        PyMem_Free(c->buckets);
+        PyMem_Free(c->nodes);
+        PyMem_Free(memo);
+        return (msgpack_memo*)PyErr_NoMemory();
+    }
+    msgpack_memo_cache_clear(c);
+    return memo;
+}
+
+// forgets what the last call met; the cache is kept
+static inline void msgpack_memo_reset(msgpack_memo* memo)
+{
+    msgpack_memo_table_clear(&memo->sized, true);
+    msgpack_memo_table_clear(&memo->written, false);
+    while (memo->pending_length) {
+        Py_DECREF(memo->pending[--memo->pending_length].key);
+    }
+}
+
+static inline void msgpack_memo_free(msgpack_memo* memo)
+{
+    if (!memo)
+        return;
+    msgpack_memo_reset(memo);
+    msgpack_memo_cache_clear(&memo->cache);
+    PyMem_Free(memo->sized.entries);
+    PyMem_Free(memo->written.entries);
+    PyMem_Free(memo->pending);
+    PyMem_Free(memo->cache.buckets);
+    PyMem_Free(memo->cache.nodes);
+    PyMem_Free(memo);
+}
+
+static inline int msgpack_memo_push_pending(msgpack_memo* memo, PyObject* key, Py_hash_t hash)
+{
+    if (memo->pending_length == memo->pending_buf_size) {
+        size_t bs = memo->pending_buf_size ? memo->pending_buf_size * 2 : 16;
+        msgpack_memo_pending* pending = (msgpack_memo_pending*)PyMem_Realloc(
+            memo->pending, bs * sizeof(msgpack_memo_pending));
+        if (!pending) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        memo->pending = pending;
+        memo->pending_buf_size = bs;
+    }
+    Py_INCREF(key);
+    memo->pending[memo->pending_length].key = key;
+    memo->pending[memo->pending_length].hash = hash;
+    memo->pending_length++;
+    return 0;
+}
+
+//
+// after a successful writing pass into buf, caches the image of every tuple
+// the sizing pass missed. A cache, so running out of memory here is ignored.
+//
+static inline void msgpack_memo_commit(msgpack_memo* memo, const char* buf)
+{
+    size_t i;
+
+    for (i = 0; i < memo->pending_length; i++) {
+        const msgpack_memo_entry* e = msgpack_memo_find(&memo->written, memo->pending[i].key);
+        PyObject* image;
+        if (e == NULL || e->size > MSGPACK_MEMO_MAX_IMAGE)
+            continue;
+        image = PyBytes_FromStringAndSize(buf + e->begin, (Py_ssize_t)e->size);
+        if (image == NULL || msgpack_memo_cache_insert(&memo->cache, memo->pending[i].key,
+                                                       memo->pending[i].hash, image))
+            PyErr_Clear();
+        Py_XDECREF(image);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* msgpack/memo.h */
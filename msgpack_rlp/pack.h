@@ -15,12 +15,18 @@
  *    See the License for the specific language governing permissions and
  *    limitations under the License.
  */
+#ifndef MSGPACK_PACK_H__
+#define MSGPACK_PACK_H__
 
 #include <stddef.h>
 #include <stdlib.h>
 #include "sysdep.h"
+#include "arena.h"
+#include "memo.h"
+#include "keccak.h"
 #include <limits.h>
 #include <string.h>
+#include "structmember.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,80 +42,411 @@ typedef struct msgpack_packer {
     size_t length;
     size_t buf_size;
     bool use_bin_type;
+    bool fixed;  // buf is memory of the caller and is never reallocated
+    bool overflowed;    // a write didn't fit a fixed buf, no exception is set
+    struct msgpack_hash *hash;  // absorbs the output as it is written
 } msgpack_packer;
 
 typedef struct Packer Packer;
 
-static inline int msgpack_pack_write(msgpack_packer* pk, const char *data, size_t l)
+//
+// Output hashed while it is written (see msgpack_encode_hash). The packer
+// gets a buffer size of one window past what was absorbed, so it comes
+// back through msgpack_pack_grow every window: that absorbs the new bytes
+// while they are still in cache. When the output is kept, the window slides
+// along a buffer of the exact encoded size. Otherwise the same window is
+// reused from the start.
+//
+#define MSGPACK_HASH_WINDOW ((size_t)16 * 1024)
+
+typedef struct msgpack_hash {
+    msgpack_keccak sponge;
+    size_t mark;        // buf before mark has been absorbed
+    size_t capacity;    // room of the kept output
+    size_t base;        // output position of buf
+    bool keep;
+} msgpack_hash;
+
+// output position, which only differs from pk->length for a reused window
+static inline size_t msgpack_pack_position(const msgpack_packer* pk)
 {
-    char* buf = pk->buf;
-    size_t bs = pk->buf_size;
-    size_t len = pk->length;
+    return pk->hash ? pk->hash->base + pk->length : pk->length;
+}
 
-    if (len + l > bs) {
-        bs = (len + l) * 2;
-        buf = (char*)PyMem_Realloc(buf, bs);
-        if (!buf) {
-            PyErr_NoMemory();
-            return -1;
-        }
-    }
-    memcpy(buf + len, data, l);
-    len += l;
+//
+// moves the buffer to one of at least need bytes taken from the buffer arena.
+// Size classes are powers of two, so this doubles like the old realloc did.
+//
+static inline int msgpack_pack_grow_buffer(msgpack_packer* pk, size_t need)
+{
+    char* buf;
+    size_t bs;
 
+    if (pk->fixed) {
+        // may run without the GIL: the caller raises, knowing what it means
+        pk->overflowed = true;
+        return -1;
+    }
+    if (msgpack_arena_class(need) < 0 && need < pk->buf_size * 2)
+        need = pk->buf_size * 2;
+    buf = msgpack_arena_acquire(need, &bs);
+    if (!buf) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (pk->length)
+        memcpy(buf, pk->buf, pk->length);
+    msgpack_arena_release(pk->buf, pk->buf_size);
     pk->buf = buf;
     pk->buf_size = bs;
-    pk->length = len;
+    return 0;
+}
+
+static inline void msgpack_pack_absorb(msgpack_packer* pk)
+{
+    msgpack_hash* h = pk->hash;
+    msgpack_keccak_absorb(&h->sponge, pk->buf + h->mark, pk->length - h->mark);
+    h->mark = pk->length;
+}
+
+static inline int msgpack_pack_grow(msgpack_packer* pk, size_t need)
+{
+    msgpack_hash* h = pk->hash;
+
+    if (h == NULL)
+        return msgpack_pack_grow_buffer(pk, need);
+    msgpack_pack_absorb(pk);
+    if (!h->keep) {
+        need -= pk->length;
+        h->base += pk->length;
+        pk->length = h->mark = 0;
+        // past the window only for a single reserve larger than it
+        return need <= pk->buf_size ? 0 : msgpack_pack_grow_buffer(pk, need);
+    }
+    if (need > h->capacity) {
+        pk->overflowed = true;
+        return -1;
+    }
+    // the next window, or up to need for a single reserve larger than it
+    pk->buf_size = pk->length + MSGPACK_HASH_WINDOW;
+    if (pk->buf_size < need)
+        pk->buf_size = need;
+    if (pk->buf_size > h->capacity)
+        pk->buf_size = h->capacity;
+    return 0;
+}
+
+//
+// hands an empty buffer that grew past the arena trim size back, so a single
+// huge message doesn't pin its memory in the packer for good
+//
+static inline void msgpack_pack_trim(msgpack_packer* pk)
+{
+    if (pk->length == 0 && !pk->fixed && pk->buf_size > msgpack_buffer_arena.trim_size) {
+        msgpack_buffer_arena.trims++;
+        msgpack_arena_release(pk->buf, pk->buf_size);
+        pk->buf = NULL;
+        pk->buf_size = 0;
+    }
+}
+
+static inline int msgpack_pack_write(msgpack_packer* pk, const char *data, size_t l)
+{
+    if (pk->length + l > pk->buf_size && msgpack_pack_grow(pk, pk->length + l))
+        return -1;
+    memcpy(pk->buf + pk->length, data, l);
+    pk->length += l;
     return 0;
 }
 
 //
-// overwrites some bytes at a given position
+// grows the buffer once so that the next l bytes can be written without
+// any further reallocation
 //
-static inline int msgpack_pack_insert_at_position(msgpack_packer* pk, const char *data, size_t l, size_t position)
+static inline int msgpack_pack_reserve(msgpack_packer* pk, size_t l)
+{
+    if (pk->length + l > pk->buf_size)
+        return msgpack_pack_grow(pk, pk->length + l);
+    return 0;
+}
+
+//
+// what the sizing pass learned about an object, in the order it was met:
+// the payload size of every list, every object returned by default() and
+// the exported buffer of every buffer object. The writing pass reads them
+// back in the same order, so it emits each list prefix before its payload
+// and never calls back into Python.
+//
+typedef struct msgpack_plan {
+    size_t *sizes;
+    size_t length;
+    size_t buf_size;
+    size_t position;
+
+    PyObject **objects;
+    size_t objects_length;
+    size_t objects_buf_size;
+    size_t objects_position;
+
+    Py_buffer *views;
+    size_t views_length;
+    size_t views_buf_size;
+    size_t views_position;
+} msgpack_plan;
+
+static inline void msgpack_plan_reset(msgpack_plan* plan)
 {
-    char* buf = pk->buf;
-    size_t bs = pk->buf_size;
-    size_t len = pk->length;
+    size_t i;
+    for (i = 0; i < plan->objects_length; i++) {
+        Py_DECREF(plan->objects[i]);
+    }
+    for (i = 0; i < plan->views_length; i++) {
+        PyBuffer_Release(&plan->views[i]);
+    }
+    plan->length = 0;
+    plan->position = 0;
+    plan->objects_length = 0;
+    plan->objects_position = 0;
+    plan->views_length = 0;
+    plan->views_position = 0;
+}
 
-    char buf_copy[bs];
+static inline void msgpack_plan_free(msgpack_plan* plan)
+{
+    msgpack_plan_reset(plan);
+    PyMem_Free(plan->sizes);
+    PyMem_Free(plan->objects);
+    PyMem_Free(plan->views);
+    plan->sizes = NULL;
+    plan->objects = NULL;
+    plan->views = NULL;
+    plan->buf_size = 0;
+    plan->objects_buf_size = 0;
+    plan->views_buf_size = 0;
+}
 
-    //First we have to extend it by length
-    if (len + l > bs) {
-        bs = (len + l) * 2;
-        buf = (char*)PyMem_Realloc(buf, bs);
-        if (!buf) {
+// reserves a slot for a list whose payload size is not known yet.
+// returns (size_t)-1 when out of memory.
+static inline size_t msgpack_plan_push(msgpack_plan* plan)
+{
+    if (plan->length == plan->buf_size) {
+        size_t bs = plan->buf_size ? plan->buf_size * 2 : 64;
+        size_t* sizes = (size_t*)PyMem_Realloc(plan->sizes, bs * sizeof(size_t));
+        if (!sizes) {
             PyErr_NoMemory();
-            return -1;
+            return (size_t)-1;
         }
+        plan->sizes = sizes;
+        plan->buf_size = bs;
     }
+    plan->sizes[plan->length] = 0;
+    return plan->length++;
+}
 
-    //can simplify this with memmove if we want
-    //first make a duplicate
-    memcpy(&buf_copy, buf + position, len-position);
+// marks in place of a list payload size, for lists the memo emits whole
+#define MSGPACK_PLAN_SHARED ((size_t)-2)    // copied from its first occurrence
+#define MSGPACK_PLAN_CACHED ((size_t)-3)    // the next plan object is its image
 
-    //now copy back but shifted
-    memcpy(buf + position + l, &buf_copy, len-position);
+// next recorded list payload size. returns (size_t)-1 when the writing pass
+// meets more lists than the sizing pass did.
+static inline size_t msgpack_plan_next(msgpack_plan* plan)
+{
+    if (plan->position >= plan->length) {
+        return (size_t)-1;
+    }
+    return plan->sizes[plan->position++];
+}
 
-    //now there is a gap of length l at position, ready to be written to
+// keeps a new reference to o until the plan is reset
+static inline int msgpack_plan_push_object(msgpack_plan* plan, PyObject* o)
+{
+    if (plan->objects_length == plan->objects_buf_size) {
+        size_t bs = plan->objects_buf_size ? plan->objects_buf_size * 2 : 16;
+        PyObject** objects = (PyObject**)PyMem_Realloc(plan->objects, bs * sizeof(PyObject*));
+        if (!objects) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        plan->objects = objects;
+        plan->objects_buf_size = bs;
+    }
+    Py_INCREF(o);
+    plan->objects[plan->objects_length++] = o;
+    return 0;
+}
 
-    memcpy(buf + position, data, l);
+// borrowed reference to the next recorded object, NULL when there is none
+static inline PyObject* msgpack_plan_next_object(msgpack_plan* plan)
+{
+    if (plan->objects_position >= plan->objects_length) {
+        return NULL;
+    }
+    return plan->objects[plan->objects_position++];
+}
 
-    len += l;
+// exports the contiguous buffer of o, with its format, and holds it until the
+// plan is reset. NULL with an exception set on error.
+static inline const Py_buffer* msgpack_plan_push_view(msgpack_plan* plan, PyObject* o)
+{
+    if (plan->views_length == plan->views_buf_size) {
+        size_t bs = plan->views_buf_size ? plan->views_buf_size * 2 : 16;
+        Py_buffer* views = (Py_buffer*)PyMem_Realloc(plan->views, bs * sizeof(Py_buffer));
+        if (!views) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        plan->views = views;
+        plan->views_buf_size = bs;
+    }
+    if (PyObject_GetBuffer(o, &plan->views[plan->views_length], PyBUF_ND | PyBUF_FORMAT))
+        return NULL;
+    return &plan->views[plan->views_length++];
+}
 
-    pk->buf = buf;
-    pk->buf_size = bs;
-    pk->length = len;
-    return 0;
+// next recorded buffer of o, NULL when the writing pass doesn't match
+static inline const Py_buffer* msgpack_plan_next_view(msgpack_plan* plan, PyObject* o)
+{
+    if (plan->views_position >= plan->views_length || plan->views[plan->views_position].obj != o) {
+        return NULL;
+    }
+    return &plan->views[plan->views_position++];
 }
 
 #define msgpack_pack_append_buffer(user, buf, len) \
         return msgpack_pack_write(user, (const char*)buf, len)
 
-#define msgpack_pack_insert_buffer(user, buf, len, position) \
-        return msgpack_pack_insert_at_position(user, (const char*)buf, len, position)
-
 #include "pack_template.h"
+#include "sedes.h"
+
+#if PY_MAJOR_VERSION >= 3
+/*
+ * str is read from its own storage (PEP 393) rather than through
+ * PyUnicode_AsUTF8AndSize, which keeps a UTF-8 copy of every non-ASCII
+ * string it is given for as long as the string lives. ASCII strings are
+ * their own UTF-8; the others are transcoded straight into the output.
+ */
+static inline int msgpack_unicode_ready(PyObject* o)
+{
+#if PY_VERSION_HEX < 0x030C0000
+    return PyUnicode_READY(o);
+#else
+    (void)o;
+    return 0;
+#endif
+}
+
+//
+// UTF-8 copy of a non-ASCII str, if something else already made one
+//
+static inline const char* msgpack_unicode_cached_utf8(PyObject* o, Py_ssize_t* len)
+{
+    const PyCompactUnicodeObject* u = (const PyCompactUnicodeObject*)o;
+    *len = u->utf8_length;
+    return u->utf8;
+}
+
+//
+// UTF-8 length of a ready, non-ASCII str, or -1 when it holds surrogates,
+// which can't be encoded. The loops have no data dependent branches, so the
+// compiler vectorizes them.
+//
+static inline Py_ssize_t msgpack_unicode_utf8_length(PyObject* o)
+{
+    Py_ssize_t i, n = PyUnicode_GET_LENGTH(o);
+    Py_ssize_t len = n;
+    const void* data = PyUnicode_DATA(o);
+    int surrogates = 0;
+
+    switch (PyUnicode_KIND(o)) {
+    case PyUnicode_1BYTE_KIND: {
+        const Py_UCS1* p = (const Py_UCS1*)data;
+        for (i = 0; i < n; i++)
+            len += p[i] >> 7;
+        return len;
+    }
+    case PyUnicode_2BYTE_KIND: {
+        const Py_UCS2* p = (const Py_UCS2*)data;
+        for (i = 0; i < n; i++) {
+            len += (p[i] >= 0x80) + (p[i] >= 0x800);
+            surrogates |= (p[i] & 0xF800) == 0xD800;
+        }
+        break;
+    }
+    default: {
+        const Py_UCS4* p = (const Py_UCS4*)data;
+        for (i = 0; i < n; i++) {
+            len += (p[i] >= 0x80) + (p[i] >= 0x800) + (p[i] >= 0x10000);
+            surrogates |= (p[i] & 0xFFFFF800) == 0xD800;
+        }
+        break;
+    }
+    }
+    return surrogates ? -1 : len;
+}
+
+static inline char* msgpack_utf8_put(char* out, Py_UCS4 c)
+{
+    if (c < 0x80) {
+        *out++ = (char)c;
+    } else if (c < 0x800) {
+        *out++ = (char)(0xC0 | (c >> 6));
+        *out++ = (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        *out++ = (char)(0xE0 | (c >> 12));
+        *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (c & 0x3F));
+    } else {
+        *out++ = (char)(0xF0 | (c >> 18));
+        *out++ = (char)(0x80 | ((c >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (c & 0x3F));
+    }
+    return out;
+}
+
+//
+// writes the UTF-8 form of a non-ASCII str without surrogates to out, which
+// has room for msgpack_unicode_utf8_length(o) bytes. Latin-1 text is mostly
+// ASCII, so it goes 8 characters at a time while they are.
+//
+static inline void msgpack_unicode_write_utf8(PyObject* o, char* out)
+{
+    Py_ssize_t i = 0, n = PyUnicode_GET_LENGTH(o);
+    const void* data = PyUnicode_DATA(o);
+
+    switch (PyUnicode_KIND(o)) {
+    case PyUnicode_1BYTE_KIND: {
+        const Py_UCS1* p = (const Py_UCS1*)data;
+        while (i < n) {
+            uint64_t w;
+            if (i + 8 <= n) {
+                memcpy(&w, p + i, 8);
+                if ((w & 0x8080808080808080ull) == 0) {
+                    memcpy(out, p + i, 8);
+                    out += 8;
+                    i += 8;
+                    continue;
+                }
+            }
+            out = msgpack_utf8_put(out, p[i++]);
+        }
+        break;
+    }
+    case PyUnicode_2BYTE_KIND: {
+        const Py_UCS2* p = (const Py_UCS2*)data;
+        for (; i < n; i++)
+            out = msgpack_utf8_put(out, p[i]);
+        break;
+    }
+    default: {
+        const Py_UCS4* p = (const Py_UCS4*)data;
+        for (; i < n; i++)
+            out = msgpack_utf8_put(out, p[i]);
+        break;
+    }
+    }
+}
+#endif
 
 // return -2 when o is too long
 static inline int
@@ -118,25 +455,46 @@ msgpack_pack_unicode(msgpack_packer *pk, PyObject *o, unsigned long long limit)
 #if PY_MAJOR_VERSION >= 3
     assert(PyUnicode_Check(o));
 
+    const char* buf;
     Py_ssize_t len;
-    const char* buf = PyUnicode_AsUTF8AndSize(o, &len);
-    if (buf == NULL)
-        return -1;
+    int ret;
 
-    if (len > limit) {
-        return -2;
+    if (msgpack_unicode_ready(o))
+        return -1;
+    if (PyUnicode_IS_ASCII(o)) {
+        len = PyUnicode_GET_LENGTH(o);
+        if ((unsigned long long)len > limit)
+            return -2;
+        // a single ASCII character is its own encoding, anything else gets
+        // a string prefix
+        if (len != 1 && (ret = msgpack_pack_raw(pk, len)))
+            return ret;
+        return msgpack_pack_raw_body(pk, PyUnicode_DATA(o), len);
     }
 
-    if (len == 1 && buf[0] < 0x80){
-        return msgpack_pack_raw_body(pk, buf, len);
+    buf = msgpack_unicode_cached_utf8(o, &len);
+    if (buf == NULL) {
+        len = msgpack_unicode_utf8_length(o);
+        // surrogates, let the codec report them
+        if (len < 0 && (buf = PyUnicode_AsUTF8AndSize(o, &len)) == NULL)
+            return -1;
     }
-    else{
-        int ret = msgpack_pack_raw(pk, len);
-
-        if (ret) return ret;
-
-        return msgpack_pack_raw_body(pk, buf, len);
+    if (buf != NULL) {
+        if ((unsigned long long)len > limit)
+            return -2;
+        return msgpack_pack_string(pk, buf, len);
     }
+    if ((unsigned long long)len > limit)
+        return -2;
+    // never a single byte: one non-ASCII character takes at least two
+    ret = msgpack_pack_raw(pk, len);
+    if (ret == 0)
+        ret = msgpack_pack_reserve(pk, len);
+    if (ret)
+        return ret;
+    msgpack_unicode_write_utf8(o, pk->buf + pk->length);
+    pk->length += len;
+    return 0;
 #else
     PyObject *bytes;
     Py_ssize_t len;
@@ -153,17 +511,1780 @@ msgpack_pack_unicode(msgpack_packer *pk, PyObject *o, unsigned long long limit)
         return -2;
     }
 
-    ret = msgpack_pack_raw(pk, len);
-    if (ret) {
-        Py_DECREF(bytes);
+    ret = msgpack_pack_string(pk, PyString_AS_STRING(bytes), len);
+    Py_DECREF(bytes);
+    return ret;
+#endif
+}
+
+// size of the encoded unicode string. return -2 when o is too long
+static inline int
+msgpack_unicode_size(PyObject *o, unsigned long long limit, size_t* size)
+{
+#if PY_MAJOR_VERSION >= 3
+    Py_ssize_t len;
+
+    if (msgpack_unicode_ready(o))
+        return -1;
+    if (PyUnicode_IS_ASCII(o)) {
+        len = PyUnicode_GET_LENGTH(o);
+        if ((unsigned long long)len > limit)
+            return -2;
+        *size = len == 1 ? 1 : msgpack_pack_header_size(len) + len;
+        return 0;
+    }
+    if (msgpack_unicode_cached_utf8(o, &len) == NULL) {
+        len = msgpack_unicode_utf8_length(o);
+        if (len < 0 && PyUnicode_AsUTF8AndSize(o, &len) == NULL)
+            return -1;
+    }
+    if ((unsigned long long)len > limit)
+        return -2;
+    *size = msgpack_pack_header_size(len) + len;
+    return 0;
+#else
+    PyObject *bytes = PyUnicode_AsUTF8String(o);
+    if (bytes == NULL)
         return -1;
+    if ((unsigned long long)PyString_GET_SIZE(bytes) > limit) {
+        Py_DECREF(bytes);
+        return -2;
     }
-    ret = msgpack_pack_raw_body(pk, PyString_AS_STRING(bytes), len);
+    *size = msgpack_pack_string_size(PyString_AS_STRING(bytes), PyString_GET_SIZE(bytes));
     Py_DECREF(bytes);
-    return ret;
+    return 0;
 #endif
 }
 
-#ifdef __cplusplus
+
+/*
+ * Encoder core
+ *
+ * Packer.pack hands the whole object to msgpack_encode, which walks it twice:
+ * msgpack_encode_size records list payload sizes and default() results in
+ * the plan, then msgpack_encode_write emits everything front to back into a
+ * buffer grown once to the exact size.
+ */
+
+#define MSGPACK_ENCODE_ERROR        -1  // a Python exception is set
+#define MSGPACK_ENCODE_NEGATIVE     -2  // negative integer
+#define MSGPACK_ENCODE_DEPTH        -3  // nest limit exceeded
+#define MSGPACK_ENCODE_UNSUPPORTED  -4  // enc->error_obj has no encoding
+#define MSGPACK_ENCODE_TOO_LARGE    -5  // enc->error_obj is too large
+#define MSGPACK_ENCODE_CHANGED      -6  // object changed between the two passes
+#define MSGPACK_ENCODE_SCHEMA       -7  // enc->error_obj doesn't match the sedes
+
+typedef enum {
+    MSGPACK_KIND_OTHER,
+    MSGPACK_KIND_NONE,
+    MSGPACK_KIND_BYTES,
+    MSGPACK_KIND_BYTEARRAY,
+    MSGPACK_KIND_UNICODE,
+    MSGPACK_KIND_INT,
+    MSGPACK_KIND_LIST,
+    MSGPACK_KIND_TUPLE,
+    MSGPACK_KIND_RAW,       // already encoded, copied verbatim
+    MSGPACK_KIND_ITER,      // any other iterable, packed as it is iterated
+    MSGPACK_KIND_BUFFER,    // any other buffer object, packed as a string
+    MSGPACK_KIND_FIELDS,    // registered type, packed as the list of its fields
+    MSGPACK_KIND_MEMO,      // list emitted whole from the memo, set by the memo alone
+} msgpack_kind;
+
+// RLPRaw, set when _packer is imported
+static PyTypeObject* msgpack_raw_type = NULL;
+
+/*
+ * Registered types
+ *
+ * Instances of a type passed to register_type(), or of a class with an
+ * __rlp_fields__ attribute, are packed as the list of their fields. The
+ * field names are resolved once per type into a layout: fields stored in
+ * __slots__ are read straight from their offset in the instance, any other
+ * field through getattr with the interned name. The sizing pass keeps the
+ * values it got from getattr in the plan, so the writing pass still never
+ * calls into Python.
+ */
+typedef enum {
+    MSGPACK_FIELD_SLOT,
+    MSGPACK_FIELD_ATTR,
+} msgpack_field_kind;
+
+typedef struct msgpack_field {
+    PyObject *name;         // interned
+    Py_ssize_t offset;      // of the slot in the instance
+    msgpack_field_kind kind;
+} msgpack_field;
+
+typedef struct msgpack_fields {
+    Py_ssize_t count;
+    msgpack_field items[1];
+} msgpack_fields;
+
+#define MSGPACK_FIELDS_CAPSULE "msgpack_rlp.fields"
+
+// type -> capsule of its layout, and "__rlp_fields__", set when _packer is imported
+static PyObject* msgpack_type_registry = NULL;
+static PyObject* msgpack_fields_attr = NULL;
+
+static void msgpack_fields_destroy(PyObject* capsule)
+{
+    msgpack_fields* layout = (msgpack_fields*)PyCapsule_GetPointer(capsule, MSGPACK_FIELDS_CAPSULE);
+    Py_ssize_t i;
+
+    for (i = 0; i < layout->count; i++) {
+        Py_DECREF(layout->items[i].name);
+    }
+    PyMem_Free(layout);
+}
+
+//
+// compiles the layout of type t for the attribute names in the sequence
+// names. Returns a new capsule, or NULL with an exception set.
+//
+static PyObject* msgpack_fields_compile(PyTypeObject* t, PyObject* names)
+{
+    PyObject* seq = PySequence_Fast(names, "fields must be a sequence of attribute names");
+    PyObject* capsule;
+    msgpack_fields* layout;
+    Py_ssize_t i, n;
+
+    if (seq == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(seq);
+    layout = (msgpack_fields*)PyMem_Malloc(sizeof(msgpack_fields) + n * sizeof(msgpack_field));
+    if (layout == NULL) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+    }
+    layout->count = 0;
+    capsule = PyCapsule_New(layout, MSGPACK_FIELDS_CAPSULE, msgpack_fields_destroy);
+    if (capsule == NULL) {
+        PyMem_Free(layout);
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++) {
+        msgpack_field* field = &layout->items[i];
+        PyObject* name = PySequence_Fast_GET_ITEM(seq, i);
+        PyObject* descr;
+
+#if PY_MAJOR_VERSION >= 3
+        if (!PyUnicode_Check(name)) {
+#else
+        if (!PyString_Check(name)) {
+#endif
+            PyErr_Format(PyExc_TypeError, "field names must be str, not %.200s",
+                         Py_TYPE(name)->tp_name);
+            Py_DECREF(capsule);
+            Py_DECREF(seq);
+            return NULL;
+        }
+        Py_INCREF(name);
+#if PY_MAJOR_VERSION >= 3
+        PyUnicode_InternInPlace(&name);
+#else
+        PyString_InternInPlace(&name);
+#endif
+        field->name = name;
+        field->kind = MSGPACK_FIELD_ATTR;
+        field->offset = 0;
+        layout->count++;
+
+        descr = _PyType_Lookup(t, name);
+        if (descr && Py_TYPE(descr) == &PyMemberDescr_Type) {
+            PyMemberDef* member = ((PyMemberDescrObject*)descr)->d_member;
+            if (member->type == T_OBJECT_EX) {
+                field->kind = MSGPACK_FIELD_SLOT;
+                field->offset = member->offset;
+            }
+        }
+    }
+    Py_DECREF(seq);
+    return capsule;
+}
+
+static inline bool msgpack_fields_registered(PyTypeObject* t)
+{
+    return msgpack_type_registry != NULL &&
+        (PyDict_GetItem(msgpack_type_registry, (PyObject*)t) != NULL ||
+         _PyType_Lookup(t, msgpack_fields_attr) != NULL);
+}
+
+//
+// layout of type t (borrowed from the registry), compiled from __rlp_fields__
+// on first use. NULL with an exception set on error.
+//
+static inline PyObject* msgpack_fields_resolve(PyTypeObject* t)
+{
+    PyObject* capsule = PyDict_GetItem(msgpack_type_registry, (PyObject*)t);
+    PyObject* names;
+    int ret;
+
+    if (capsule)
+        return capsule;
+    names = _PyType_Lookup(t, msgpack_fields_attr);
+    if (names == NULL) {
+        PyErr_Format(PyExc_TypeError, "%.200s is not registered", t->tp_name);
+        return NULL;
+    }
+    capsule = msgpack_fields_compile(t, names);
+    if (capsule == NULL)
+        return NULL;
+    ret = PyDict_SetItem(msgpack_type_registry, (PyObject*)t, capsule);
+    Py_DECREF(capsule);
+    return ret ? NULL : capsule;
+}
+
+// layout of type t if the sizing pass resolved it, NULL otherwise
+static inline const msgpack_fields* msgpack_fields_lookup(PyTypeObject* t)
+{
+    PyObject* capsule = PyDict_GetItem(msgpack_type_registry, (PyObject*)t);
+    return capsule ? (const msgpack_fields*)PyCapsule_GetPointer(capsule, MSGPACK_FIELDS_CAPSULE) : NULL;
+}
+
+// one open list on the work stack
+typedef struct msgpack_encode_frame {
+    PyObject *seq;          // owned during the sizing pass, borrowed while writing
+    PyObject *fields;       // capsule of the layout of a registered type, owned
+                            // during the sizing pass
+    const msgpack_fields *layout;
+    msgpack_kind kind;
+    Py_ssize_t index;       // next item
+    size_t slot;            // plan slot of the payload size
+    size_t payload;         // bytes seen so far (sizing) or expected (writing)
+    size_t start;           // first snapshot token (sizing) or output position
+                            // of the payload (writing)
+} msgpack_encode_frame;
+
+struct msgpack_ir;
+
+typedef struct msgpack_encoder {
+    PyObject *default_fn;   // borrowed from the Packer, may be NULL
+    bool strict_types;
+    size_t max_depth;       // deepest nesting accepted, the root is depth 0
+    msgpack_plan plan;
+    PyObject *error_obj;    // object the last error refers to
+    struct msgpack_ir *ir;  // when set, the sizing pass also snapshots leaves
+    msgpack_memo *memo;     // owned, when set repeated lists are emitted whole
+    const msgpack_sedes *sedes;     // borrowed, when set objects are packed by it
+
+    // heap allocated so that nesting costs no C stack, kept between calls
+    msgpack_encode_frame *stack;
+    size_t stack_size;
+} msgpack_encoder;
+
+static inline void msgpack_encoder_init(msgpack_encoder* enc)
+{
+    memset(enc, 0, sizeof(msgpack_encoder));
+}
+
+static inline void msgpack_encoder_free(msgpack_encoder* enc)
+{
+    msgpack_plan_free(&enc->plan);
+    msgpack_memo_free(enc->memo);
+    enc->memo = NULL;
+    Py_CLEAR(enc->error_obj);
+    PyMem_Free(enc->stack);
+    enc->stack = NULL;
+    enc->stack_size = 0;
 }
+
+// forgets everything learned about the last object but the memo cache
+static inline void msgpack_encoder_reset(msgpack_encoder* enc)
+{
+    msgpack_plan_reset(&enc->plan);
+    if (enc->memo)
+        msgpack_memo_reset(enc->memo);
+}
+
+// returns the frame at depth top, growing the stack if needed
+static inline msgpack_encode_frame* msgpack_encoder_frame(msgpack_encoder* enc, size_t top)
+{
+    if (top == enc->stack_size) {
+        size_t n = enc->stack_size ? enc->stack_size * 2 : 32;
+        msgpack_encode_frame* stack = (msgpack_encode_frame*)PyMem_Realloc(
+            enc->stack, n * sizeof(msgpack_encode_frame));
+        if (!stack) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        enc->stack = stack;
+        enc->stack_size = n;
+    }
+    return &enc->stack[top];
+}
+
+static inline int msgpack_encoder_fail(msgpack_encoder* enc, int ret, PyObject* o)
+{
+    Py_INCREF(o);
+    Py_XDECREF(enc->error_obj);
+    enc->error_obj = o;
+    return ret;
+}
+
+//
+// kinds found by protocol rather than by type. Registered types are lists
+// of their fields. Iterators (generators, cursors, ...) are lists; unless
+// types are strict, so are other iterables except mappings, and buffer
+// objects (array, mmap, numpy, ...) are strings.
+// With a default() still to be called, other iterables are left to it: it
+// can convert them, or return them as they are to have them packed as lists.
+//
+static inline msgpack_kind msgpack_protocol_kind(PyObject* o, bool strict, bool defer)
+{
+    if (msgpack_fields_registered(Py_TYPE(o)))
+        return MSGPACK_KIND_FIELDS;
+    if (PyIter_Check(o))
+        return MSGPACK_KIND_ITER;
+    if (strict)
+        return MSGPACK_KIND_OTHER;
+    if (PyObject_CheckBuffer(o))
+        return MSGPACK_KIND_BUFFER;
+    if (defer || Py_TYPE(o)->tp_iter == NULL || PyDict_Check(o))
+        return MSGPACK_KIND_OTHER;
+    return MSGPACK_KIND_ITER;
+}
+
+// exact types are checked first, they are all the hot paths ever see.
+// default_used is set once default() has converted o.
+static inline msgpack_kind msgpack_encoder_kind(const msgpack_encoder* enc, PyObject* o,
+                                                bool default_used)
+{
+    PyTypeObject* t = Py_TYPE(o);
+
+    if (t == &PyBytes_Type) return MSGPACK_KIND_BYTES;
+    if (t == &PyLong_Type) return MSGPACK_KIND_INT;
+    if (t == &PyList_Type) return MSGPACK_KIND_LIST;
+    if (o == Py_None) return MSGPACK_KIND_NONE;
+    if (t == &PyUnicode_Type) return MSGPACK_KIND_UNICODE;
+    if (t == &PyByteArray_Type) return MSGPACK_KIND_BYTEARRAY;
+    if (t == msgpack_raw_type) return MSGPACK_KIND_RAW;
+    if (t == &PyMemoryView_Type) return MSGPACK_KIND_BUFFER;
+    if (enc->strict_types) return msgpack_protocol_kind(o, true, false);
+
+    // tuples are lists unless types are strict
+    if (t == &PyTuple_Type) return MSGPACK_KIND_TUPLE;
+    if (PyBytes_Check(o)) return MSGPACK_KIND_BYTES;
+    if (PyByteArray_Check(o)) return MSGPACK_KIND_BYTEARRAY;
+    if (PyUnicode_Check(o)) return MSGPACK_KIND_UNICODE;
+    if (PyLong_Check(o)) return MSGPACK_KIND_INT;
+    if (PyTuple_Check(o)) return MSGPACK_KIND_TUPLE;
+    if (PyList_Check(o)) return MSGPACK_KIND_LIST;
+    return msgpack_protocol_kind(o, false, !default_used && enc->default_fn != NULL);
+}
+
+//
+// reads a python int as an unsigned 64 bit value.
+// returns 0 when it fits, 1 when it is too large, 2 when it is negative
+// and -1 with an exception set on error. Small ints are read straight from
+// their digits without going through the generic conversion.
+//
+static inline int msgpack_long_as_uint64(PyObject* o, uint64_t* d)
+{
+#if PY_VERSION_HEX >= 0x030C0000
+    if (PyUnstable_Long_IsCompact((PyLongObject*)o)) {
+        Py_ssize_t v = PyUnstable_Long_CompactValue((PyLongObject*)o);
+        if (v < 0) return 2;
+        *d = (uint64_t)v;
+        return 0;
+    }
+#elif PY_MAJOR_VERSION >= 3
+    const digit* digits = ((PyLongObject*)o)->ob_digit;
+    switch (Py_SIZE(o)) {
+    case 0:
+        *d = 0;
+        return 0;
+    case 1:
+        *d = digits[0];
+        return 0;
+    case 2:
+        *d = (uint64_t)digits[0] | ((uint64_t)digits[1] << PyLong_SHIFT);
+        return 0;
+    default:
+        if (Py_SIZE(o) < 0) return 2;
+    }
 #endif
+    unsigned PY_LONG_LONG v = PyLong_AsUnsignedLongLong(o);
+    if (v == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred()) {
+        if (!PyErr_ExceptionMatches(PyExc_OverflowError))
+            return -1;
+        PyErr_Clear();
+        return _PyLong_Sign(o) < 0 ? 2 : 1;
+    }
+    *d = (uint64_t)v;
+    return 0;
+}
+
+// digits of a python int, least significant first
+static inline Py_ssize_t msgpack_long_digits(PyObject* o, const digit** digits)
+{
+#if PY_VERSION_HEX >= 0x030C0000
+    *digits = ((PyLongObject*)o)->long_value.ob_digit;
+    return (Py_ssize_t)(((PyLongObject*)o)->long_value.lv_tag >> _PyLong_NON_SIZE_BITS);
+#else
+    *digits = ((PyLongObject*)o)->ob_digit;
+    return Py_SIZE(o) < 0 ? -Py_SIZE(o) : Py_SIZE(o);
+#endif
+}
+
+// length of the minimal big endian image of a non negative int
+static inline size_t msgpack_long_byte_length(PyObject* o)
+{
+    size_t bits = _PyLong_NumBits(o);
+    if (bits == (size_t)-1 && PyErr_Occurred())
+        return (size_t)-1;
+    return (bits + 7) / 8;
+}
+
+//
+// writes a non negative int too large for 64 bits as an RLP string.
+// The big endian image goes straight into the buffer, without any
+// intermediate python object.
+//
+static inline int msgpack_pack_bigint(msgpack_packer* pk, PyObject* o)
+{
+    size_t n = msgpack_long_byte_length(o);
+    unsigned char* p;
+    int ret;
+
+    if (n == (size_t)-1)
+        return -1;
+    ret = msgpack_pack_raw(pk, n);
+    if (ret)
+        return ret;
+    if (msgpack_pack_reserve(pk, n))
+        return -1;
+    p = (unsigned char*)pk->buf + pk->length;
+
+    if (n <= 32) {
+        // up to 256 bits (balances, hashes, signatures): gather the digits
+        // into four 64 bit limbs and store them big endian
+        uint64_t limbs[4] = {0, 0, 0, 0};
+        unsigned char image[32];
+        const digit* digits;
+        Py_ssize_t ndigits = msgpack_long_digits(o, &digits);
+        Py_ssize_t i;
+        size_t shift = 0;
+
+        for (i = 0; i < ndigits; i++, shift += PyLong_SHIFT) {
+            uint64_t d = digits[i];
+            size_t limb = shift / 64;
+            size_t bit = shift % 64;
+            limbs[limb] |= d << bit;
+            if (bit + PyLong_SHIFT > 64 && limb < 3)
+                limbs[limb + 1] |= d >> (64 - bit);
+        }
+        _msgpack_store64(&image[0], limbs[3]);
+        _msgpack_store64(&image[8], limbs[2]);
+        _msgpack_store64(&image[16], limbs[1]);
+        _msgpack_store64(&image[24], limbs[0]);
+        memcpy(p, image + 32 - n, n);
+    } else {
+#if PY_VERSION_HEX >= 0x030D0000
+        if (_PyLong_AsByteArray((PyLongObject*)o, p, n, 0, 0, 1) < 0)
+            return -1;
+#else
+        if (_PyLong_AsByteArray((PyLongObject*)o, p, n, 0, 0) < 0)
+            return -1;
+#endif
+    }
+    pk->length += n;
+    return 0;
+}
+
+//
+// item width of view when it holds unsigned ints (typecodes I, L and Q, with
+// an optional byte order) that are packed as a list of integers, 0 when it
+// is packed as a string. *swap is set when the items are byte swapped; on
+// big endian hosts, little endian arrays are strings.
+//
+static inline unsigned int msgpack_view_uint_width(const Py_buffer* view, bool* swap)
+{
+    const char* f = view->format;
+
+    *swap = false;
+    if (f == NULL)
+        return 0;
+    switch (*f) {
+    case '@':
+    case '=':
+        f++;
+        break;
+#ifdef __LITTLE_ENDIAN__
+    case '<':
+        f++;
+        break;
+    case '>':
+    case '!':
+        *swap = true;
+        f++;
+        break;
+#else
+    case '>':
+    case '!':
+        f++;
+        break;
+#endif
+    }
+    if ((f[0] != 'I' && f[0] != 'L' && f[0] != 'Q') || f[1] != '\0')
+        return 0;
+    if ((view->itemsize != 4 && view->itemsize != 8) || view->len % view->itemsize)
+        return 0;
+    return (unsigned int)view->itemsize;
+}
+
+//
+// packs the n items at p as a list of integers whose payload the sizing
+// pass found to be payload bytes. The whole list is reserved at once and
+// each item is a single store; only the last few go through a copy, so
+// nothing is written past the payload.
+//
+static inline int msgpack_pack_uint_array(msgpack_packer* pk, const char* p, size_t n,
+                                          unsigned int width, bool swap, size_t payload)
+{
+    char tmp[9];
+    char *out, *end;
+    size_t i, k;
+
+    if (msgpack_pack_array(pk, payload) || msgpack_pack_reserve(pk, payload))
+        return MSGPACK_ENCODE_ERROR;
+    out = pk->buf + pk->length;
+    end = out + payload;
+    for (i = 0; i < n; i++) {
+        uint64_t d = msgpack_uint_array_item(p + i * width, width, swap);
+        if (end - out >= 9) {
+            out += msgpack_store_uint(out, d);
+            continue;
+        }
+        // the items can change while default() runs between the passes
+        k = msgpack_store_uint(tmp, d);
+        if (k > (size_t)(end - out))
+            return MSGPACK_ENCODE_CHANGED;
+        memcpy(out, tmp, k);
+        out += k;
+    }
+    if (out != end)
+        return MSGPACK_ENCODE_CHANGED;
+    pk->length += payload;
+    return 0;
+}
+
+static inline PyObject* msgpack_sequence_item(PyObject* seq, msgpack_kind kind, Py_ssize_t i)
+{
+    return kind == MSGPACK_KIND_LIST ? PyList_GET_ITEM(seq, i) : PyTuple_GET_ITEM(seq, i);
+}
+
+static inline bool msgpack_kind_is_sequence(msgpack_kind kind)
+{
+    return kind == MSGPACK_KIND_LIST || kind == MSGPACK_KIND_TUPLE || kind == MSGPACK_KIND_FIELDS;
+}
+
+static inline Py_ssize_t msgpack_frame_length(const msgpack_encode_frame* f)
+{
+    return f->kind == MSGPACK_KIND_FIELDS ? f->layout->count : Py_SIZE(f->seq);
+}
+
+// next item of f in the sizing pass, NULL with an exception set on error
+static inline PyObject* msgpack_frame_size_item(msgpack_encoder* enc, msgpack_encode_frame* f)
+{
+    const msgpack_field* field;
+    PyObject* v;
+    int ret;
+
+    if (f->kind != MSGPACK_KIND_FIELDS)
+        return msgpack_sequence_item(f->seq, f->kind, f->index++);
+    field = &f->layout->items[f->index++];
+    if (field->kind == MSGPACK_FIELD_SLOT) {
+        v = *(PyObject**)((char*)f->seq + field->offset);
+        if (v == NULL)
+            PyErr_SetObject(PyExc_AttributeError, field->name);
+        return v;
+    }
+    v = PyObject_GetAttr(f->seq, field->name);
+    if (v == NULL)
+        return NULL;
+    ret = msgpack_plan_push_object(&enc->plan, v);
+    Py_DECREF(v);
+    return ret ? NULL : v;
+}
+
+// next item of f in the writing pass, NULL when it doesn't match the sizing
+static inline PyObject* msgpack_frame_write_item(msgpack_encoder* enc, msgpack_encode_frame* f)
+{
+    const msgpack_field* field;
+
+    if (f->kind != MSGPACK_KIND_FIELDS)
+        return msgpack_sequence_item(f->seq, f->kind, f->index++);
+    field = &f->layout->items[f->index++];
+    if (field->kind == MSGPACK_FIELD_SLOT)
+        return *(PyObject**)((char*)f->seq + field->offset);
+    return msgpack_plan_next_object(&enc->plan);
+}
+
+static inline int msgpack_encode(msgpack_encoder* enc, msgpack_packer* pk, PyObject* o);
+
+//
+// packs the items of the iterable o, found at nesting depth depth, into a
+// new bytes object holding the whole list. Each item is packed as soon as
+// the iterator yields it, after room for the longest list prefix, so only
+// the encoding is kept and the payload is never shifted.
+//
+static int msgpack_encode_iterable(msgpack_encoder* enc, PyObject* o, size_t depth,
+                                   PyObject** result)
+{
+    msgpack_encoder items;
+    msgpack_packer pk;
+    PyObject *it, *item;
+    size_t start;
+    int ret;
+
+    *result = NULL;
+    it = PyObject_GetIter(o);
+    if (it == NULL)
+        return MSGPACK_ENCODE_ERROR;
+    if (Py_EnterRecursiveCall(" while packing an iterable")) {
+        Py_DECREF(it);
+        return MSGPACK_ENCODE_ERROR;
+    }
+    msgpack_encoder_init(&items);
+    items.default_fn = enc->default_fn;
+    items.strict_types = enc->strict_types;
+    items.max_depth = depth < enc->max_depth ? enc->max_depth - depth - 1 : 0;
+    memset(&pk, 0, sizeof(pk));
+    ret = msgpack_pack_reserve(&pk, MSGPACK_MAX_HEADER_SIZE);
+    pk.length = MSGPACK_MAX_HEADER_SIZE;
+
+    while (ret == 0 && (item = PyIter_Next(it)) != NULL) {
+        if (depth >= enc->max_depth)
+            ret = MSGPACK_ENCODE_DEPTH;
+        else
+            ret = msgpack_encode(&items, &pk, item);
+        Py_DECREF(item);
+    }
+    if (ret == 0 && PyErr_Occurred())
+        ret = MSGPACK_ENCODE_ERROR;
+    if (ret == 0) {
+        start = MSGPACK_MAX_HEADER_SIZE - msgpack_pack_array_before(
+            pk.buf + MSGPACK_MAX_HEADER_SIZE, pk.length - MSGPACK_MAX_HEADER_SIZE);
+        *result = PyBytes_FromStringAndSize(pk.buf + start, pk.length - start);
+        if (*result == NULL)
+            ret = MSGPACK_ENCODE_ERROR;
+    }
+    if (items.error_obj) {
+        Py_XDECREF(enc->error_obj);
+        enc->error_obj = items.error_obj;
+        items.error_obj = NULL;
+    }
+    msgpack_arena_release(pk.buf, pk.buf_size);
+    msgpack_encoder_free(&items);
+    Py_LeaveRecursiveCall();
+    Py_DECREF(it);
+    return ret;
+}
+
+//
+// sizing pass, one object. Sizes scalars and resolves default(). Lists are
+// left to the caller, which opens a frame for them; *o is replaced by the
+// object default() returned, if any.
+//
+static inline int msgpack_encode_size_object(msgpack_encoder* enc, PyObject** o, size_t depth,
+                                             msgpack_kind* kind, size_t* size)
+{
+    bool default_used = false;
+    int ret;
+
+    for (;;) {
+        *kind = msgpack_encoder_kind(enc, *o, default_used);
+        switch (*kind) {
+        case MSGPACK_KIND_NONE:
+            *size = 1;
+            return 0;
+        case MSGPACK_KIND_BYTES:
+            *size = msgpack_pack_string_size(PyBytes_AS_STRING(*o), PyBytes_GET_SIZE(*o));
+            return 0;
+        case MSGPACK_KIND_BYTEARRAY:
+            *size = msgpack_pack_string_size(PyByteArray_AS_STRING(*o), PyByteArray_GET_SIZE(*o));
+            return 0;
+        case MSGPACK_KIND_RAW:
+            *size = PyBytes_GET_SIZE(*o);
+            return 0;
+        case MSGPACK_KIND_BUFFER: {
+            // read in place, the export also keeps it from being resized
+            const Py_buffer* view = msgpack_plan_push_view(&enc->plan, *o);
+            unsigned int width;
+            bool swap;
+            if (view == NULL)
+                return MSGPACK_ENCODE_ERROR;
+            width = msgpack_view_uint_width(view, &swap);
+            if (width) {
+                size_t slot = msgpack_plan_push(&enc->plan);
+                if (slot == (size_t)-1)
+                    return MSGPACK_ENCODE_ERROR;
+                enc->plan.sizes[slot] = msgpack_pack_uint_array_size(
+                    (const char*)view->buf, view->len / width, width, swap);
+                *size = msgpack_pack_header_size(enc->plan.sizes[slot]) + enc->plan.sizes[slot];
+                return 0;
+            }
+            *size = msgpack_pack_string_size(view->buf, view->len);
+            return 0;
+        }
+        case MSGPACK_KIND_UNICODE:
+            ret = msgpack_unicode_size(*o, ULLONG_MAX, size);
+            if (ret == -2)
+                return msgpack_encoder_fail(enc, MSGPACK_ENCODE_TOO_LARGE, *o);
+            return ret;
+        case MSGPACK_KIND_INT: {
+            uint64_t d;
+            ret = msgpack_long_as_uint64(*o, &d);
+            if (ret == 0) {
+                *size = msgpack_pack_uint64_size(d);
+                return 0;
+            }
+            if (ret == 1) {
+                size_t n = msgpack_long_byte_length(*o);
+                if (n == (size_t)-1)
+                    return MSGPACK_ENCODE_ERROR;
+                *size = msgpack_pack_header_size(n) + n;
+                return 0;
+            }
+            if (ret == 2)
+                return MSGPACK_ENCODE_NEGATIVE;
+            return MSGPACK_ENCODE_ERROR;
+        }
+        case MSGPACK_KIND_LIST:
+        case MSGPACK_KIND_TUPLE:
+        case MSGPACK_KIND_FIELDS:
+        case MSGPACK_KIND_MEMO:
+            return 0;
+        case MSGPACK_KIND_ITER: {
+            // can only be iterated once, the writing pass copies the result
+            PyObject* res;
+            ret = msgpack_encode_iterable(enc, *o, depth, &res);
+            if (ret)
+                return ret;
+            ret = msgpack_plan_push_object(&enc->plan, res);
+            Py_DECREF(res);
+            if (ret)
+                return MSGPACK_ENCODE_ERROR;
+            *o = res;
+            *size = PyBytes_GET_SIZE(res);
+            return 0;
+        }
+        case MSGPACK_KIND_OTHER:
+            if (default_used || enc->default_fn == NULL)
+                return msgpack_encoder_fail(enc, MSGPACK_ENCODE_UNSUPPORTED, *o);
+            break;
+        }
+
+        // the writing pass reuses this result instead of calling default() again
+        PyObject* res = PyObject_CallFunctionObjArgs(enc->default_fn, *o, NULL);
+        if (res == NULL)
+            return MSGPACK_ENCODE_ERROR;
+        ret = msgpack_plan_push_object(&enc->plan, res);
+        Py_DECREF(res);
+        if (ret)
+            return MSGPACK_ENCODE_ERROR;
+        *o = res;   // the plan keeps it alive
+        default_used = true;
+    }
+}
+
+
+/*
+ * Snapshot
+ *
+ * With enc->ir set, the sizing pass also records every item in a flat token
+ * list, in the order the writing pass would emit them. Writing the tokens
+ * back needs nothing but the plan sizes, so it can run without the GIL (see
+ * batch.h). Bytes and ASCII str payloads are referenced in place and their
+ * objects kept alive; values with no stable immutable image (bytearray and
+ * other buffer objects, big ints, str that isn't ASCII) are encoded right
+ * away into a side buffer, so the writing pass sees no Python object change.
+ * Only a snapshot with borrow_buffers set references buffer objects as well.
+ */
+typedef enum {
+    MSGPACK_IR_NIL,
+    MSGPACK_IR_UINT,
+    MSGPACK_IR_STRING,      // payload, gets a string prefix
+    MSGPACK_IR_VERBATIM,    // encoded bytes, copied as they are
+    MSGPACK_IR_SIDE,        // encoded bytes in the side buffer, until finished
+    MSGPACK_IR_LIST,
+} msgpack_ir_kind;
+
+typedef struct msgpack_ir_token {
+    const char *data;       // STRING and VERBATIM
+    PyObject *object;       // bytes object holding data, if any (borrowed)
+    size_t length;          // STRING, VERBATIM and SIDE
+    uint64_t value;         // UINT value, LIST plan slot, SIDE offset
+    msgpack_ir_kind kind;
+} msgpack_ir_token;
+
+typedef struct msgpack_ir {
+    msgpack_ir_token *tokens;
+    size_t length;
+    size_t buf_size;
+
+    PyObject **refs;        // owned references to the referenced payloads
+    size_t refs_length;
+    size_t refs_buf_size;
+
+    msgpack_packer side;
+
+    // buffer objects are referenced in place too, for a snapshot that is
+    // written out before any Python code could change them
+    bool borrow_buffers;
+} msgpack_ir;
+
+static inline void msgpack_ir_init(msgpack_ir* ir)
+{
+    memset(ir, 0, sizeof(msgpack_ir));
+}
+
+static inline void msgpack_ir_free(msgpack_ir* ir)
+{
+    while (ir->refs_length) {
+        Py_DECREF(ir->refs[--ir->refs_length]);
+    }
+    PyMem_Free(ir->refs);
+    PyMem_Free(ir->tokens);
+    msgpack_arena_release(ir->side.buf, ir->side.buf_size);
+    msgpack_ir_init(ir);
+}
+
+static inline msgpack_ir_token* msgpack_ir_push(msgpack_ir* ir, msgpack_ir_kind kind)
+{
+    msgpack_ir_token* t;
+    if (ir->length == ir->buf_size) {
+        size_t bs = ir->buf_size ? ir->buf_size * 2 : 256;
+        msgpack_ir_token* tokens = (msgpack_ir_token*)PyMem_Realloc(
+            ir->tokens, bs * sizeof(msgpack_ir_token));
+        if (!tokens) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        ir->tokens = tokens;
+        ir->buf_size = bs;
+    }
+    t = &ir->tokens[ir->length++];
+    memset(t, 0, sizeof(msgpack_ir_token));
+    t->kind = kind;
+    return t;
+}
+
+static inline int msgpack_ir_keep(msgpack_ir* ir, PyObject* o)
+{
+    if (ir->refs_length == ir->refs_buf_size) {
+        size_t bs = ir->refs_buf_size ? ir->refs_buf_size * 2 : 256;
+        PyObject** refs = (PyObject**)PyMem_Realloc(ir->refs, bs * sizeof(PyObject*));
+        if (!refs) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        ir->refs = refs;
+        ir->refs_buf_size = bs;
+    }
+    Py_INCREF(o);
+    ir->refs[ir->refs_length++] = o;
+    return 0;
+}
+
+static inline int msgpack_ir_list(msgpack_ir* ir, size_t slot)
+{
+    msgpack_ir_token* t = msgpack_ir_push(ir, MSGPACK_IR_LIST);
+    if (!t)
+        return MSGPACK_ENCODE_ERROR;
+    t->value = slot;
+    return 0;
+}
+
+// records a scalar the sizing pass has already checked
+static inline int msgpack_ir_leaf(msgpack_ir* ir, const msgpack_plan* plan, PyObject* o,
+                                  msgpack_kind kind)
+{
+    msgpack_ir_token* t = msgpack_ir_push(ir, MSGPACK_IR_SIDE);
+    size_t start = ir->side.length;
+    int ret;
+
+    if (!t)
+        return MSGPACK_ENCODE_ERROR;
+    switch (kind) {
+    case MSGPACK_KIND_NONE:
+        t->kind = MSGPACK_IR_NIL;
+        return 0;
+    case MSGPACK_KIND_BYTES:
+        t->kind = MSGPACK_IR_STRING;
+        t->object = o;
+        t->data = PyBytes_AS_STRING(o);
+        t->length = PyBytes_GET_SIZE(o);
+        return msgpack_ir_keep(ir, o);
+    case MSGPACK_KIND_BUFFER: {
+        // the buffer the sizing pass just exported, held by the plan
+        const Py_buffer* view = &plan->views[plan->views_length - 1];
+        bool swap;
+        unsigned int width = msgpack_view_uint_width(view, &swap);
+        if (width) {
+            // its payload size is the plan slot taken last
+            ret = msgpack_pack_uint_array(&ir->side, (const char*)view->buf, view->len / width,
+                                          width, swap, plan->sizes[plan->length - 1]);
+            break;
+        }
+        if (ir->borrow_buffers) {
+            t->kind = MSGPACK_IR_STRING;
+            t->object = o;
+            t->data = (const char*)view->buf;
+            t->length = view->len;
+            return msgpack_ir_keep(ir, o);
+        }
+        // copied like a bytearray: its owner can still change it
+        ret = msgpack_pack_string(&ir->side, (const char*)view->buf, view->len);
+        break;
+    }
+    case MSGPACK_KIND_RAW:
+    case MSGPACK_KIND_ITER:     // o is the encoding the sizing pass made
+        t->kind = MSGPACK_IR_VERBATIM;
+        t->object = o;
+        t->data = PyBytes_AS_STRING(o);
+        t->length = PyBytes_GET_SIZE(o);
+        return msgpack_ir_keep(ir, o);
+
+    case MSGPACK_KIND_INT: {
+        uint64_t d;
+        ret = msgpack_long_as_uint64(o, &d);
+        if (ret == 0) {
+            t->kind = MSGPACK_IR_UINT;
+            t->value = d;
+            return 0;
+        }
+        ret = ret == 1 ? msgpack_pack_bigint(&ir->side, o) : MSGPACK_ENCODE_ERROR;
+        break;
+    }
+    case MSGPACK_KIND_BYTEARRAY:
+        ret = msgpack_pack_string(&ir->side, PyByteArray_AS_STRING(o), PyByteArray_GET_SIZE(o));
+        break;
+    case MSGPACK_KIND_UNICODE:
+#if PY_MAJOR_VERSION >= 3
+        if (PyUnicode_IS_ASCII(o)) {
+            // its own UTF-8, read in place (the sizing pass made it ready)
+            t->kind = MSGPACK_IR_STRING;
+            t->data = (const char*)PyUnicode_DATA(o);
+            t->length = PyUnicode_GET_LENGTH(o);
+            return msgpack_ir_keep(ir, o);
+        }
+#endif
+        ret = msgpack_pack_unicode(&ir->side, o, ULLONG_MAX);
+        break;
+    default:
+        PyErr_SetString(PyExc_SystemError, "unexpected kind in snapshot");
+        return MSGPACK_ENCODE_ERROR;
+    }
+    t->value = start;
+    t->length = ir->side.length - start;
+    return ret;
+}
+
+// the side buffer is complete and won't move anymore
+static inline void msgpack_ir_finish(msgpack_ir* ir)
+{
+    size_t i;
+    for (i = 0; i < ir->length; i++) {
+        if (ir->tokens[i].kind == MSGPACK_IR_SIDE) {
+            ir->tokens[i].kind = MSGPACK_IR_VERBATIM;
+            ir->tokens[i].data = ir->side.buf + ir->tokens[i].value;
+        }
+    }
+}
+
+//
+// writes tokens [begin, end). Touches no python object, only the plan sizes.
+//
+static inline int msgpack_ir_write(const msgpack_ir* ir, const size_t* sizes,
+                                   size_t begin, size_t end, msgpack_packer* pk)
+{
+    size_t i;
+    int ret = 0;
+
+    for (i = begin; i < end && ret == 0; i++) {
+        const msgpack_ir_token* t = &ir->tokens[i];
+        switch (t->kind) {
+        case MSGPACK_IR_NIL:
+            ret = msgpack_pack_nil(pk);
+            break;
+        case MSGPACK_IR_UINT:
+            ret = msgpack_pack_uint(pk, t->value);
+            break;
+        case MSGPACK_IR_STRING:
+            ret = msgpack_pack_string(pk, t->data, t->length);
+            break;
+        case MSGPACK_IR_VERBATIM:
+            ret = msgpack_pack_raw_body(pk, t->data, t->length);
+            break;
+        case MSGPACK_IR_SIDE:
+            return MSGPACK_ENCODE_ERROR;
+        case MSGPACK_IR_LIST:
+            ret = msgpack_pack_array(pk, sizes[t->value]);
+            break;
+        }
+    }
+    return ret;
+}
+
+// records tokens [begin, end) again, for a list met a second time
+static inline int msgpack_ir_repeat(msgpack_ir* ir, size_t begin, size_t end)
+{
+    size_t i;
+    for (i = begin; i < end; i++) {
+        msgpack_ir_token* t = msgpack_ir_push(ir, MSGPACK_IR_NIL);
+        if (!t)
+            return MSGPACK_ENCODE_ERROR;
+        *t = ir->tokens[i];
+    }
+    return 0;
+}
+
+//
+// sizing pass, a list about to be opened. When the memo has it already,
+// *kind becomes MSGPACK_KIND_MEMO, *size is set and the plan marks how the
+// writing pass gets its bytes. Tuples that miss the cache are noted so their
+// image is cached once written.
+//
+static inline int msgpack_encode_size_memo(msgpack_encoder* enc, PyObject* o,
+                                           msgpack_kind* kind, size_t* size)
+{
+    msgpack_memo* memo = enc->memo;
+    const msgpack_memo_entry* e = msgpack_memo_find(&memo->sized, o);
+    PyObject* image;
+    Py_hash_t hash;
+    size_t slot;
+    int ret;
+
+    if (e != NULL) {
+        slot = msgpack_plan_push(&enc->plan);
+        if (slot == (size_t)-1)
+            return MSGPACK_ENCODE_ERROR;
+        enc->plan.sizes[slot] = MSGPACK_PLAN_SHARED;
+        if (enc->ir && msgpack_ir_repeat(enc->ir, e->begin, e->end))
+            return MSGPACK_ENCODE_ERROR;
+        memo->shared++;
+        *kind = MSGPACK_KIND_MEMO;
+        *size = e->size;
+        return 0;
+    }
+    if (memo->cache.capacity == 0 || !PyTuple_CheckExact(o) || !msgpack_memo_cacheable(o, 0))
+        return 0;
+
+    hash = PyObject_Hash(o);
+    if (hash == -1)
+        return MSGPACK_ENCODE_ERROR;
+    ret = msgpack_memo_cache_find(&memo->cache, o, hash, &image);
+    if (ret < 0)
+        return MSGPACK_ENCODE_ERROR;
+    if (ret == 0) {
+        memo->cache.misses++;
+        return msgpack_memo_push_pending(memo, o, hash) ? MSGPACK_ENCODE_ERROR : 0;
+    }
+    memo->cache.hits++;
+    slot = msgpack_plan_push(&enc->plan);
+    if (slot == (size_t)-1 || msgpack_plan_push_object(&enc->plan, image))
+        return MSGPACK_ENCODE_ERROR;
+    enc->plan.sizes[slot] = MSGPACK_PLAN_CACHED;
+    if (enc->ir && msgpack_ir_leaf(enc->ir, &enc->plan, image, MSGPACK_KIND_RAW))
+        return MSGPACK_ENCODE_ERROR;
+    *kind = MSGPACK_KIND_MEMO;
+    *size = PyBytes_GET_SIZE(image);
+    return 0;
+}
+
+
+/*
+ * Sedes
+ *
+ * With enc->sedes set, objects are packed by the sedes instead of by their
+ * type: every value is checked against what the sedes expects there, and
+ * the first one that doesn't match fails the sizing pass before anything is
+ * written. default() isn't called. Lists of the sedes can be lists, tuples
+ * or registered objects. The nesting is bounded by the sedes, so both passes
+ * simply recurse.
+ */
+
+// payload of o where the sedes wants bytes. false when o isn't bytes
+static inline bool msgpack_sedes_bytes(PyObject* o, const char** p, size_t* n, msgpack_kind* kind)
+{
+    if (PyBytes_Check(o) && Py_TYPE(o) != msgpack_raw_type) {
+        *p = PyBytes_AS_STRING(o);
+        *n = PyBytes_GET_SIZE(o);
+        *kind = MSGPACK_KIND_BYTES;
+        return true;
+    }
+    if (PyByteArray_Check(o)) {
+        *p = PyByteArray_AS_STRING(o);
+        *n = PyByteArray_GET_SIZE(o);
+        *kind = MSGPACK_KIND_BYTEARRAY;
+        return true;
+    }
+    return false;
+}
+
+//
+// opens o where the sedes wants a list. Returns 1, 0 when o isn't a list
+// and -1 with an exception set on error. The sizing pass owns f->fields.
+//
+static inline int msgpack_sedes_open(msgpack_encode_frame* f, PyObject* o, bool sizing)
+{
+    f->seq = o;
+    f->fields = NULL;
+    f->layout = NULL;
+    f->index = 0;
+    if (PyList_Check(o)) {
+        f->kind = MSGPACK_KIND_LIST;
+        return 1;
+    }
+    if (PyTuple_Check(o)) {
+        f->kind = MSGPACK_KIND_TUPLE;
+        return 1;
+    }
+    if (!msgpack_fields_registered(Py_TYPE(o)))
+        return 0;
+    f->kind = MSGPACK_KIND_FIELDS;
+    if (!sizing) {
+        f->layout = msgpack_fields_lookup(Py_TYPE(o));
+        return f->layout ? 1 : 0;
+    }
+    f->fields = msgpack_fields_resolve(Py_TYPE(o));
+    if (f->fields == NULL)
+        return -1;
+    Py_INCREF(f->fields);
+    f->layout = (const msgpack_fields*)PyCapsule_GetPointer(f->fields, MSGPACK_FIELDS_CAPSULE);
+    return 1;
+}
+
+static int msgpack_sedes_size(msgpack_encoder* enc, size_t node, PyObject* o, size_t* size);
+
+static int msgpack_sedes_size_list(msgpack_encoder* enc, size_t node, PyObject* o, size_t* size)
+{
+    const msgpack_sede* d = &enc->sedes->nodes[node];
+    msgpack_encode_frame f;
+    size_t slot = (size_t)-1;
+    size_t payload = 0, item_size;
+    Py_ssize_t n;
+    int ret = msgpack_sedes_open(&f, o, true);
+
+    if (ret <= 0)
+        return ret ? MSGPACK_ENCODE_ERROR : msgpack_encoder_fail(enc, MSGPACK_ENCODE_SCHEMA, o);
+    n = msgpack_frame_length(&f);
+    if (d->kind == MSGPACK_SEDE_RECORD && (size_t)n != d->length) {
+        Py_XDECREF(f.fields);
+        return msgpack_encoder_fail(enc, MSGPACK_ENCODE_SCHEMA, o);
+    }
+    // the prefix of a fixed size record is known, only snapshots need a slot
+    if (d->size == 0 || enc->ir) {
+        slot = msgpack_plan_push(&enc->plan);
+        if (slot == (size_t)-1 || (enc->ir && msgpack_ir_list(enc->ir, slot))) {
+            Py_XDECREF(f.fields);
+            return MSGPACK_ENCODE_ERROR;
+        }
+    }
+
+    Py_INCREF(o);   // reading a field may drop the last other reference
+    ret = 0;
+    while (ret == 0 && f.index < n) {
+        size_t item = d->kind == MSGPACK_SEDE_RECORD ?
+            enc->sedes->children[d->items + f.index] : d->items;
+        PyObject* value;
+        // reading a field runs Python code, which may resize the list
+        if (msgpack_frame_length(&f) != n) {
+            ret = MSGPACK_ENCODE_CHANGED;
+            break;
+        }
+        value = msgpack_frame_size_item(enc, &f);
+        if (value == NULL) {
+            ret = MSGPACK_ENCODE_ERROR;
+            break;
+        }
+        ret = msgpack_sedes_size(enc, item, value, &item_size);
+        payload += item_size;
+    }
+    Py_DECREF(o);
+    Py_XDECREF(f.fields);
+    if (ret)
+        return ret;
+    if (slot != (size_t)-1)
+        enc->plan.sizes[slot] = payload;
+    *size = msgpack_pack_header_size(payload) + payload;
+    return 0;
+}
+
+// sizing pass under the sedes, node being the one o is packed by
+static int msgpack_sedes_size(msgpack_encoder* enc, size_t node, PyObject* o, size_t* size)
+{
+    const msgpack_sede* d = &enc->sedes->nodes[node];
+    msgpack_kind kind;
+    const char* p;
+    size_t n;
+    uint64_t v;
+    int ret;
+
+    switch (d->kind) {
+    case MSGPACK_SEDE_BYTES:
+    case MSGPACK_SEDE_FIXED:
+        if (!msgpack_sedes_bytes(o, &p, &n, &kind) ||
+                (d->kind == MSGPACK_SEDE_FIXED && n != d->length))
+            return msgpack_encoder_fail(enc, MSGPACK_ENCODE_SCHEMA, o);
+        *size = d->size ? d->size : msgpack_pack_string_size(p, n);
+        break;
+    case MSGPACK_SEDE_UINT:
+        if (!PyLong_Check(o))
+            return msgpack_encoder_fail(enc, MSGPACK_ENCODE_SCHEMA, o);
+        ret = msgpack_long_as_uint64(o, &v);
+        if (ret < 0)
+            return MSGPACK_ENCODE_ERROR;
+        if (ret == 0) {
+            if (d->length < 8 && v >> (8 * d->length) != 0)
+                return msgpack_encoder_fail(enc, MSGPACK_ENCODE_SCHEMA, o);
+            *size = msgpack_pack_uint64_size(v);
+        } else if (ret == 1) {
+            n = msgpack_long_byte_length(o);
+            if (n == (size_t)-1)
+                return MSGPACK_ENCODE_ERROR;
+            if (n > d->length)
+                return msgpack_encoder_fail(enc, MSGPACK_ENCODE_SCHEMA, o);
+            *size = msgpack_pack_header_size(n) + n;
+        } else {
+            return msgpack_encoder_fail(enc, MSGPACK_ENCODE_SCHEMA, o);
+        }
+        kind = MSGPACK_KIND_INT;
+        break;
+    default:
+        return msgpack_sedes_size_list(enc, node, o, size);
+    }
+    return enc->ir ? msgpack_ir_leaf(enc->ir, &enc->plan, o, kind) : 0;
+}
+
+// sizing pass
+static int msgpack_encode_size(msgpack_encoder* enc, PyObject* o, size_t* total)
+{
+    msgpack_encode_frame* f;
+    msgpack_kind kind;
+    size_t top = 0;
+    size_t size;
+    int ret;
+
+    if (enc->sedes)
+        return msgpack_sedes_size(enc, 0, o, total);
+    for (;;) {
+        if (top > enc->max_depth) {
+            ret = MSGPACK_ENCODE_DEPTH;
+            goto fail;
+        }
+        ret = msgpack_encode_size_object(enc, &o, top, &kind, &size);
+        if (ret == 0 && enc->memo && msgpack_kind_is_sequence(kind))
+            ret = msgpack_encode_size_memo(enc, o, &kind, &size);
+        if (ret)
+            goto fail;
+
+        if (msgpack_kind_is_sequence(kind)) {
+            PyObject* fields = NULL;
+            if (kind == MSGPACK_KIND_FIELDS) {
+                fields = msgpack_fields_resolve(Py_TYPE(o));
+                if (fields == NULL) {
+                    ret = MSGPACK_ENCODE_ERROR;
+                    goto fail;
+                }
+            }
+            f = msgpack_encoder_frame(enc, top);
+            if (f == NULL) {
+                ret = MSGPACK_ENCODE_ERROR;
+                goto fail;
+            }
+            f->slot = msgpack_plan_push(&enc->plan);
+            if (f->slot == (size_t)-1) {
+                ret = MSGPACK_ENCODE_ERROR;
+                goto fail;
+            }
+            if (enc->ir && msgpack_ir_list(enc->ir, f->slot)) {
+                ret = MSGPACK_ENCODE_ERROR;
+                goto fail;
+            }
+            // default() may drop the last other reference to the list, or
+            // register its type again
+            Py_INCREF(o);
+            Py_XINCREF(fields);
+            f->seq = o;
+            f->fields = fields;
+            f->layout = fields ? (const msgpack_fields*)PyCapsule_GetPointer(
+                fields, MSGPACK_FIELDS_CAPSULE) : NULL;
+            f->kind = kind;
+            f->index = 0;
+            f->payload = 0;
+            f->start = enc->ir ? enc->ir->length - 1 : 0;
+            ++top;
+        } else {
+            if (enc->ir && kind != MSGPACK_KIND_MEMO) {
+                ret = msgpack_ir_leaf(enc->ir, &enc->plan, o, kind);
+                if (ret)
+                    goto fail;
+            }
+            if (top == 0) {
+                *total = size;
+                return 0;
+            }
+            enc->stack[top - 1].payload += size;
+        }
+
+        // next item, closing every list that is done
+        for (;;) {
+            f = &enc->stack[top - 1];
+            if (f->index < msgpack_frame_length(f)) {
+                o = msgpack_frame_size_item(enc, f);
+                if (o == NULL) {
+                    ret = MSGPACK_ENCODE_ERROR;
+                    goto fail;
+                }
+                break;
+            }
+            enc->plan.sizes[f->slot] = f->payload;
+            size = msgpack_pack_header_size(f->payload) + f->payload;
+            if (enc->memo) {
+                msgpack_memo_entry* e = msgpack_memo_insert(&enc->memo->sized, f->seq, true);
+                if (e == NULL) {
+                    ret = MSGPACK_ENCODE_ERROR;
+                    goto fail;
+                }
+                e->begin = f->start;
+                e->end = enc->ir ? enc->ir->length : 0;
+                e->size = size;
+            }
+            Py_DECREF(f->seq);
+            Py_XDECREF(f->fields);
+            if (--top == 0) {
+                *total = size;
+                return 0;
+            }
+            enc->stack[top - 1].payload += size;
+        }
+    }
+
+fail:
+    while (top) {
+        --top;
+        Py_DECREF(enc->stack[top].seq);
+        Py_XDECREF(enc->stack[top].fields);
+    }
+    return ret;
+}
+
+//
+// writing pass, a list the sizing pass may have left to the memo. Emits it
+// and sets *kind to MSGPACK_KIND_MEMO if so.
+//
+static inline int msgpack_encode_write_memo(msgpack_encoder* enc, msgpack_packer* pk,
+                                            PyObject* o, msgpack_kind* kind)
+{
+    msgpack_plan* plan = &enc->plan;
+    const msgpack_memo_entry* e;
+    PyObject* image;
+
+    if (plan->position >= plan->length)
+        return 0;   // the caller finds the plan exhausted
+    switch (plan->sizes[plan->position]) {
+    case MSGPACK_PLAN_SHARED:
+        plan->position++;
+        *kind = MSGPACK_KIND_MEMO;
+        e = msgpack_memo_find(&enc->memo->written, o);
+        if (e == NULL)
+            return MSGPACK_ENCODE_CHANGED;
+        // reserved first, the copy comes from the same buffer
+        if (msgpack_pack_reserve(pk, e->size))
+            return MSGPACK_ENCODE_ERROR;
+        memcpy(pk->buf + pk->length, pk->buf + e->begin, e->size);
+        pk->length += e->size;
+        return 0;
+    case MSGPACK_PLAN_CACHED:
+        plan->position++;
+        *kind = MSGPACK_KIND_MEMO;
+        image = msgpack_plan_next_object(plan);
+        if (image == NULL || !PyBytes_CheckExact(image))
+            return MSGPACK_ENCODE_CHANGED;
+        return msgpack_pack_raw_body(pk, PyBytes_AS_STRING(image), PyBytes_GET_SIZE(image));
+    }
+    return 0;
+}
+
+//
+// writing pass, one object. Emits scalars; lists are left to the caller.
+// *o is replaced by the object default() returned during the sizing pass.
+//
+static inline int msgpack_encode_write_object(msgpack_encoder* enc, msgpack_packer* pk,
+                                              PyObject** o, msgpack_kind* kind)
+{
+    bool default_used = false;
+    int ret;
+
+    for (;;) {
+        *kind = msgpack_encoder_kind(enc, *o, default_used);
+        switch (*kind) {
+        case MSGPACK_KIND_NONE:
+            return msgpack_pack_nil(pk);
+        case MSGPACK_KIND_BYTES:
+            return msgpack_pack_string(pk, PyBytes_AS_STRING(*o), PyBytes_GET_SIZE(*o));
+        case MSGPACK_KIND_BYTEARRAY:
+            return msgpack_pack_string(pk, PyByteArray_AS_STRING(*o), PyByteArray_GET_SIZE(*o));
+        case MSGPACK_KIND_RAW:
+            return msgpack_pack_raw_body(pk, PyBytes_AS_STRING(*o), PyBytes_GET_SIZE(*o));
+        case MSGPACK_KIND_BUFFER: {
+            const Py_buffer* view = msgpack_plan_next_view(&enc->plan, *o);
+            unsigned int width;
+            bool swap;
+            if (view == NULL)
+                return MSGPACK_ENCODE_CHANGED;
+            width = msgpack_view_uint_width(view, &swap);
+            if (width) {
+                size_t payload = msgpack_plan_next(&enc->plan);
+                if (payload == (size_t)-1)
+                    return MSGPACK_ENCODE_CHANGED;
+                return msgpack_pack_uint_array(pk, (const char*)view->buf, view->len / width,
+                                               width, swap, payload);
+            }
+            return msgpack_pack_string(pk, view->buf, view->len);
+        }
+        case MSGPACK_KIND_ITER:
+            // consumed by the sizing pass, which kept the encoding
+            *o = msgpack_plan_next_object(&enc->plan);
+            if (*o == NULL || !PyBytes_CheckExact(*o))
+                return MSGPACK_ENCODE_CHANGED;
+            return msgpack_pack_raw_body(pk, PyBytes_AS_STRING(*o), PyBytes_GET_SIZE(*o));
+        case MSGPACK_KIND_UNICODE:
+            return msgpack_pack_unicode(pk, *o, ULLONG_MAX);
+        case MSGPACK_KIND_INT: {
+            uint64_t d;
+            ret = msgpack_long_as_uint64(*o, &d);
+            if (ret == 0)
+                return msgpack_pack_uint(pk, d);
+            if (ret == 1)
+                return msgpack_pack_bigint(pk, *o);
+            if (ret == 2)
+                return MSGPACK_ENCODE_NEGATIVE;
+            return MSGPACK_ENCODE_ERROR;
+        }
+        case MSGPACK_KIND_LIST:
+        case MSGPACK_KIND_TUPLE:
+        case MSGPACK_KIND_FIELDS:
+            if (enc->memo)
+                return msgpack_encode_write_memo(enc, pk, *o, kind);
+            return 0;
+        case MSGPACK_KIND_MEMO:
+            return 0;
+        case MSGPACK_KIND_OTHER:
+            if (default_used)
+                return msgpack_encoder_fail(enc, MSGPACK_ENCODE_UNSUPPORTED, *o);
+            break;
+        }
+
+        *o = msgpack_plan_next_object(&enc->plan);
+        if (*o == NULL)
+            return MSGPACK_ENCODE_CHANGED;
+        default_used = true;
+    }
+}
+
+// writing pass under the sedes, which the sizing pass has checked o against
+static int msgpack_sedes_write(msgpack_encoder* enc, msgpack_packer* pk, size_t node, PyObject* o)
+{
+    const msgpack_sede* d = &enc->sedes->nodes[node];
+    msgpack_encode_frame f;
+    msgpack_kind kind;
+    const char* p;
+    size_t n, payload, start;
+    uint64_t v;
+    int ret;
+
+    switch (d->kind) {
+    case MSGPACK_SEDE_BYTES:
+    case MSGPACK_SEDE_FIXED:
+        if (!msgpack_sedes_bytes(o, &p, &n, &kind) ||
+                (d->kind == MSGPACK_SEDE_FIXED && n != d->length))
+            return MSGPACK_ENCODE_CHANGED;
+        return msgpack_pack_string(pk, p, n);
+    case MSGPACK_SEDE_UINT:
+        if (!PyLong_Check(o))
+            return MSGPACK_ENCODE_CHANGED;
+        ret = msgpack_long_as_uint64(o, &v);
+        if (ret == 0)
+            return msgpack_pack_uint(pk, v);
+        // wider than 64 bits, the sizing pass checked it fits the sedes
+        return ret == 1 ? msgpack_pack_bigint(pk, o) : MSGPACK_ENCODE_CHANGED;
+    default:
+        break;
+    }
+
+    if (msgpack_sedes_open(&f, o, false) != 1)
+        return MSGPACK_ENCODE_CHANGED;
+    n = msgpack_frame_length(&f);
+    if (d->kind == MSGPACK_SEDE_RECORD && n != d->length)
+        return MSGPACK_ENCODE_CHANGED;
+    payload = d->size ? d->payload : msgpack_plan_next(&enc->plan);
+    if (payload == (size_t)-1)
+        return MSGPACK_ENCODE_CHANGED;
+    ret = msgpack_pack_array(pk, payload);
+    start = msgpack_pack_position(pk);
+    while (ret == 0 && (size_t)f.index < n) {
+        size_t item = d->kind == MSGPACK_SEDE_RECORD ?
+            enc->sedes->children[d->items + f.index] : d->items;
+        PyObject* value = msgpack_frame_write_item(enc, &f);
+        if (value == NULL)
+            return MSGPACK_ENCODE_CHANGED;
+        ret = msgpack_sedes_write(enc, pk, item, value);
+    }
+    if (ret == 0 && msgpack_pack_position(pk) - start != payload)
+        ret = MSGPACK_ENCODE_CHANGED;
+    return ret;
+}
+
+// writing pass. Never calls into Python, so borrowed references stay valid.
+static int msgpack_encode_write(msgpack_encoder* enc, msgpack_packer* pk, PyObject* o)
+{
+    msgpack_encode_frame* f;
+    msgpack_kind kind;
+    size_t top = 0;
+    int ret;
+
+    if (enc->sedes)
+        return msgpack_sedes_write(enc, pk, 0, o);
+    for (;;) {
+        ret = msgpack_encode_write_object(enc, pk, &o, &kind);
+        if (ret)
+            return ret;
+
+        if (msgpack_kind_is_sequence(kind)) {
+            size_t payload = msgpack_plan_next(&enc->plan);
+            if (payload == (size_t)-1)
+                return MSGPACK_ENCODE_CHANGED;
+            ret = msgpack_pack_array(pk, payload);
+            if (ret)
+                return ret;
+            f = msgpack_encoder_frame(enc, top);
+            if (f == NULL)
+                return MSGPACK_ENCODE_ERROR;
+            f->seq = o;
+            f->fields = NULL;
+            f->layout = NULL;
+            if (kind == MSGPACK_KIND_FIELDS) {
+                f->layout = msgpack_fields_lookup(Py_TYPE(o));
+                if (f->layout == NULL)
+                    return MSGPACK_ENCODE_CHANGED;
+            }
+            f->kind = kind;
+            f->index = 0;
+            f->payload = payload;
+            f->start = msgpack_pack_position(pk);
+            ++top;
+        } else if (top == 0) {
+            return 0;
+        }
+
+        for (;;) {
+            f = &enc->stack[top - 1];
+            if (f->index < msgpack_frame_length(f)) {
+                o = msgpack_frame_write_item(enc, f);
+                if (o == NULL)
+                    return MSGPACK_ENCODE_CHANGED;
+                break;
+            }
+            if (msgpack_pack_position(pk) - f->start != f->payload)
+                return MSGPACK_ENCODE_CHANGED;
+            if (enc->memo) {
+                msgpack_memo_entry* e = msgpack_memo_insert(&enc->memo->written, f->seq, false);
+                if (e == NULL)
+                    return MSGPACK_ENCODE_ERROR;
+                e->begin = f->start - msgpack_pack_header_size(f->payload);
+                e->size = pk->length - e->begin;
+            }
+            if (--top == 0)
+                return 0;
+        }
+    }
+}
+
+//
+// encodes o at the end of pk->buf. On error pk->length is left where the
+// object started and the plan is released either way.
+//
+static inline int msgpack_encode(msgpack_encoder* enc, msgpack_packer* pk, PyObject* o)
+{
+    size_t start = pk->length;
+    size_t size;
+    int ret;
+
+    msgpack_encoder_reset(enc);
+    ret = msgpack_encode_size(enc, o, &size);
+    if (ret == 0)
+        ret = msgpack_pack_reserve(pk, size);
+    if (ret == 0)
+        ret = msgpack_encode_write(enc, pk, o);
+    if (ret == 0 && pk->length - start != size)
+        ret = MSGPACK_ENCODE_CHANGED;
+    if (ret == 0 && enc->memo)
+        msgpack_memo_commit(enc->memo, pk->buf);
+    if (ret)
+        pk->length = start;
+    msgpack_encoder_reset(enc);
+    return ret;
+}
+
+//
+// the encoded size of o, from the sizing pass alone
+//
+static inline int msgpack_encoded_length(msgpack_encoder* enc, PyObject* o, size_t* size)
+{
+    int ret;
+
+    msgpack_encoder_reset(enc);
+    ret = msgpack_encode_size(enc, o, size);
+    msgpack_encoder_reset(enc);
+    return ret;
+}
+
+//
+// write pass into size bytes of memory that can't grow. The sizing pass made
+// it exactly large enough, so running out of room means o changed under us.
+//
+static inline int msgpack_encode_write_fixed(msgpack_encoder* enc, PyObject* o,
+                                             char* buf, size_t size)
+{
+    msgpack_packer pk;
+    int ret;
+
+    memset(&pk, 0, sizeof(pk));
+    pk.buf = buf;
+    pk.buf_size = size;
+    pk.fixed = true;
+    ret = msgpack_encode_write(enc, &pk, o);
+    if (ret == MSGPACK_ENCODE_ERROR && pk.overflowed)
+        ret = MSGPACK_ENCODE_CHANGED;
+    if (ret == 0 && pk.length != size)
+        ret = MSGPACK_ENCODE_CHANGED;
+    if (ret == 0 && enc->memo)
+        msgpack_memo_commit(enc->memo, buf);
+    return ret;
+}
+
+//
+// encodes o into avail bytes of caller memory at buf. *size receives the
+// encoded size; when it is larger than avail nothing is written.
+//
+static inline int msgpack_encode_into(msgpack_encoder* enc, PyObject* o,
+                                      char* buf, size_t avail, size_t* size)
+{
+    int ret;
+
+    msgpack_encoder_reset(enc);
+    ret = msgpack_encode_size(enc, o, size);
+    if (ret == 0 && *size <= avail)
+        ret = msgpack_encode_write_fixed(enc, o, buf, *size);
+    msgpack_encoder_reset(enc);
+    return ret;
+}
+
+//
+// encodes o into a new bytes object of exactly the encoded size, so the
+// result needs neither a copy out of the packer buffer nor a resize.
+//
+static inline int msgpack_encode_bytes(msgpack_encoder* enc, PyObject* o, PyObject** result)
+{
+    PyObject* res = NULL;
+    size_t size;
+    int ret;
+
+    msgpack_encoder_reset(enc);
+    ret = msgpack_encode_size(enc, o, &size);
+    if (ret == 0) {
+        if (size > PY_SSIZE_T_MAX)
+            PyErr_NoMemory();
+        else
+            res = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)size);
+        if (!res)
+            ret = MSGPACK_ENCODE_ERROR;
+    }
+    if (ret == 0) {
+        ret = msgpack_encode_write_fixed(enc, o, PyBytes_AS_STRING(res), size);
+        if (ret)
+            Py_CLEAR(res);
+    }
+    msgpack_encoder_reset(enc);
+    *result = res;
+    return ret;
+}
+
+//
+// encodes o and hashes the encoding with Keccak-256 in the same pass, see
+// msgpack_hash. With result non-NULL *result receives the encoding as a
+// bytes object of the exact size, otherwise only the digest is made.
+//
+static inline int msgpack_encode_hash(msgpack_encoder* enc, PyObject* o,
+                                      PyObject** result, unsigned char* digest)
+{
+    PyObject* res = NULL;
+    msgpack_packer pk;
+    msgpack_hash h;
+    size_t size, bs = 0;
+    int ret;
+
+    memset(&pk, 0, sizeof(pk));
+    memset(&h, 0, sizeof(h));
+    msgpack_encoder_reset(enc);
+    ret = msgpack_encode_size(enc, o, &size);
+    if (ret == 0 && size > PY_SSIZE_T_MAX) {
+        PyErr_NoMemory();
+        ret = MSGPACK_ENCODE_ERROR;
+    }
+    if (ret == 0) {
+        // the memo copies repeated lists from earlier output, so that has to
+        // stay around even when only the digest is wanted
+        h.keep = result != NULL || enc->memo != NULL;
+        if (result) {
+            res = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)size);
+            if (res)
+                pk.buf = PyBytes_AS_STRING(res);
+        } else {
+            pk.buf = msgpack_arena_acquire(h.keep ? size : MSGPACK_HASH_WINDOW, &bs);
+            if (!pk.buf)
+                PyErr_NoMemory();
+        }
+        if (!pk.buf)
+            ret = MSGPACK_ENCODE_ERROR;
+    }
+    if (ret == 0) {
+        msgpack_keccak_init(&h.sponge);
+        h.capacity = size;
+        pk.buf_size = h.keep ? (size < MSGPACK_HASH_WINDOW ? size : MSGPACK_HASH_WINDOW) : bs;
+        pk.fixed = h.keep;
+        pk.hash = &h;
+        ret = msgpack_encode_write(enc, &pk, o);
+        if (ret == MSGPACK_ENCODE_ERROR && pk.overflowed)
+            ret = MSGPACK_ENCODE_CHANGED;
+    }
+    if (ret == 0) {
+        msgpack_pack_absorb(&pk);
+        if (msgpack_pack_position(&pk) != size)
+            ret = MSGPACK_ENCODE_CHANGED;
+    }
+    if (ret == 0) {
+        msgpack_keccak_final(&h.sponge, digest);
+        if (enc->memo)
+            msgpack_memo_commit(enc->memo, pk.buf);
+    }
+    if (!result)
+        msgpack_arena_release(pk.buf, h.keep ? bs : pk.buf_size);
+    else if (ret)
+        Py_CLEAR(res);
+    msgpack_encoder_reset(enc);
+    if (result)
+        *result = res;
+    return ret;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* msgpack/pack.h */
@@ -41,144 +41,134 @@
  * Integer
  */
 
-#define msgpack_pack_real_uint8(x, d) \
-do { \
-    if(d < (1<<7)) { \
-        /* fixnum */ \
-        msgpack_pack_append_buffer(x, &TAKE8_8(d), 1); \
-    } else { \
-        /* unsigned 8 */ \
-        unsigned char buf[2] = {0xcc, TAKE8_8(d)}; \
-        msgpack_pack_append_buffer(x, buf, 2); \
-    } \
-} while(0)
+/*
+ * Number of bytes needed to store d as a big endian integer with no
+ * leading zeros, 0 for 0.
+ */
+static inline unsigned int msgpack_pack_uint64_width(uint64_t d)
+{
+    return d ? 8 - (_msgpack_clz64(d) >> 3) : 0;
+}
 
-#define msgpack_pack_real_uint16(x, d) \
-do { \
-    if(d < (1<<7)) { \
-        /* fixnum */ \
-        msgpack_pack_append_buffer(x, &TAKE8_16(d), 1); \
-    } else if(d < (1<<8)) { \
-        /* unsigned 8 */ \
-        unsigned char buf[2] = {0xcc, TAKE8_16(d)}; \
-        msgpack_pack_append_buffer(x, buf, 2); \
-    } else { \
-        /* unsigned 16 */ \
-        unsigned char buf[3]; \
-        buf[0] = 0xcd; _msgpack_store16(&buf[1], (uint16_t)d); \
-        msgpack_pack_append_buffer(x, buf, 3); \
-    } \
-} while(0)
+/*
+ * Writes a one byte tag followed by the n low bytes of d in big endian
+ * order. d is shifted to the top of the word so that tag and payload are
+ * laid out with a single byte-swapped 64 bit store.
+ */
+static inline int msgpack_pack_tagged_be(msgpack_packer* x, unsigned char tag, uint64_t d, unsigned int n)
+{
+    unsigned char buf[9];
+    buf[0] = tag;
+    _msgpack_store64(&buf[1], n ? d << (64 - 8 * n) : 0);
+    msgpack_pack_append_buffer(x, buf, 1 + n);
+}
 
-#define msgpack_pack_real_uint32(x, d) \
-do { \
-    if(d < (1<<8)) { \
-        if(d < (1<<7)) { \
-            /* fixnum */ \
-            msgpack_pack_append_buffer(x, &TAKE8_32(d), 1); \
-        } else { \
-            /* unsigned 8 */ \
-            unsigned char buf[2] = {0xcc, TAKE8_32(d)}; \
-            msgpack_pack_append_buffer(x, buf, 2); \
-        } \
-    } else { \
-        if(d < (1<<16)) { \
-            /* unsigned 16 */ \
-            unsigned char buf[3]; \
-            buf[0] = 0xcd; _msgpack_store16(&buf[1], (uint16_t)d); \
-            msgpack_pack_append_buffer(x, buf, 3); \
-        } else { \
-            /* unsigned 32 */ \
-            unsigned char buf[5]; \
-            buf[0] = 0xce; _msgpack_store32(&buf[1], (uint32_t)d); \
-            msgpack_pack_append_buffer(x, buf, 5); \
-        } \
-    } \
-} while(0)
+/*
+ * RLP encoding of an unsigned integer: values below 0x80 are their own
+ * encoding, 0 is the empty string, anything else is a short string holding
+ * the minimal big endian image.
+ */
+static inline int msgpack_pack_uint(msgpack_packer* x, uint64_t d)
+{
+    unsigned int n;
+    if (d < 0x80) {
+        unsigned char c = d ? (unsigned char)d : 0x80;
+        msgpack_pack_append_buffer(x, &c, 1);
+    }
+    n = msgpack_pack_uint64_width(d);
+    return msgpack_pack_tagged_be(x, 0x80 + n, d, n);
+}
 
-#define msgpack_pack_real_uint64(x, d) \
-do { \
-    if(d < (1ULL<<8)) { \
-        if(d < (1ULL<<7)) { \
-            /* fixnum */ \
-            msgpack_pack_append_buffer(x, &TAKE8_64(d), 1); \
-        } else { \
-            /* unsigned 8 */ \
-            unsigned char s = 0x80 | (uint8_t)1; \
-            unsigned char buf[2] = {s, TAKE8_64(d)}; \
-            msgpack_pack_append_buffer(x, buf, 2); \
-        } \
-    } else { \
-        if(d < (1ULL<<16)) { \
-            /* unsigned 16 */ \
-            unsigned char s = 0x80 | (uint8_t)2; \
-            unsigned char buf[3]; \
-            buf[0] = s; _msgpack_store16(&buf[1], (uint16_t)d); \
-            msgpack_pack_append_buffer(x, buf, 3); \
-        } else if(d < (1ULL<<24)) { \
-            /* unsigned 24 */ \
-            unsigned char s = 0x80 | (uint8_t)3; \
-            unsigned char buf[4]; \
-            unsigned char padded_buf[4]; \
-            buf[0] = s; _msgpack_store32(&padded_buf[0], (uint32_t)d); \
-            buf[1] = padded_buf[1]; \
-            buf[2] = padded_buf[2]; \
-            buf[3] = padded_buf[3]; \
-            msgpack_pack_append_buffer(x, buf, 4); \
-        } else if(d < (1ULL<<32)) { \
-            /* unsigned 32 */ \
-            unsigned char s = 0x80 | (uint8_t)4; \
-            unsigned char buf[5]; \
-            buf[0] = s; _msgpack_store32(&buf[1], (uint32_t)d); \
-            msgpack_pack_append_buffer(x, buf, 5); \
-        } else if(d < (1ULL<<40)) { \
-            /* unsigned 40 */ \
-            unsigned char s = 0x80 | (uint8_t)5; \
-            unsigned char buf[6]; \
-            unsigned char padded_buf[8]; \
-            buf[0] = s; _msgpack_store64(&padded_buf[0], (uint64_t)d); \
-            buf[1] = padded_buf[3]; \
-            buf[2] = padded_buf[4]; \
-            buf[3] = padded_buf[5]; \
-            buf[4] = padded_buf[6]; \
-            buf[5] = padded_buf[7]; \
-            msgpack_pack_append_buffer(x, buf, 6); \
-        } else if(d < (1ULL<<48)) { \
-            /* unsigned 48 */ \
-            unsigned char s = 0x80 | (uint8_t)6; \
-            unsigned char buf[7]; \
-            unsigned char padded_buf[8]; \
-            buf[0] = s; _msgpack_store64(&padded_buf[0], (uint64_t)d); \
-            buf[1] = padded_buf[2]; \
-            buf[2] = padded_buf[3]; \
-            buf[3] = padded_buf[4]; \
-            buf[4] = padded_buf[5]; \
-            buf[5] = padded_buf[6]; \
-            buf[6] = padded_buf[7]; \
-            msgpack_pack_append_buffer(x, buf, 7); \
-        } else if(d < (1ULL<<56)) { \
-            /* unsigned 56 */ \
-            unsigned char s = 0x80 | (uint8_t)7; \
-            unsigned char buf[8]; \
-            unsigned char padded_buf[8]; \
-            buf[0] = s; _msgpack_store64(&padded_buf[0], (uint64_t)d); \
-            buf[1] = padded_buf[1]; \
-            buf[2] = padded_buf[2]; \
-            buf[3] = padded_buf[3]; \
-            buf[4] = padded_buf[4]; \
-            buf[5] = padded_buf[5]; \
-            buf[6] = padded_buf[6]; \
-            buf[7] = padded_buf[7]; \
-            msgpack_pack_append_buffer(x, buf, 8); \
-        } else { \
-            /* unsigned 64 */ \
-            unsigned char s = 0x80 | (uint8_t)8; \
-            unsigned char buf[9]; \
-            buf[0] = s; _msgpack_store64(&buf[1], d); \
-            msgpack_pack_append_buffer(x, buf, 9); \
-        } \
-    } \
-} while(0)
+/*
+ * Integer arrays
+ *
+ * Items of an unsigned int array are read straight from its memory: width
+ * is 4 or 8 bytes and swap is set when they are stored byte swapped.
+ * The encoded size of an item is a sum of comparisons rather than a clz, so
+ * the sizing loops vectorize.
+ */
+#define MSGPACK_UINT_SIZE(d) (1 + ((d) > 0x7fU) + ((d) > 0xffU) + ((d) > 0xffffU) + \
+        ((d) > 0xffffffU) + ((d) > 0xffffffffULL) + ((d) > 0xffffffffffULL) + \
+        ((d) > 0xffffffffffffULL) + ((d) > 0xffffffffffffffULL))
+
+#define _msgpack_same(x) (x)
+
+#define MSGPACK_UINT_ARRAY_SIZE_LOOP(type, load) \
+    for (i = 0; i < n; i++) { \
+        type v; \
+        uint64_t d; \
+        memcpy(&v, p + i * sizeof(type), sizeof(type)); \
+        d = load(v); \
+        total += MSGPACK_UINT_SIZE(d); \
+    }
+
+static inline size_t msgpack_pack_uint_array_size(const char* p, size_t n,
+                                                  unsigned int width, bool swap)
+{
+    size_t total = 0;
+    size_t i;
+
+    if (width == 4 && !swap) {
+        MSGPACK_UINT_ARRAY_SIZE_LOOP(uint32_t, _msgpack_same)
+    } else if (width == 4) {
+        MSGPACK_UINT_ARRAY_SIZE_LOOP(uint32_t, _msgpack_be32)
+    } else if (!swap) {
+        MSGPACK_UINT_ARRAY_SIZE_LOOP(uint64_t, _msgpack_same)
+    } else {
+        MSGPACK_UINT_ARRAY_SIZE_LOOP(uint64_t, _msgpack_be64)
+    }
+    return total;
+}
+
+static inline uint64_t msgpack_uint_array_item(const char* p, unsigned int width, bool swap)
+{
+    if (width == 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return swap ? _msgpack_be32(v) : v;
+    } else {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        return swap ? _msgpack_be64(v) : v;
+    }
+}
+
+/*
+ * Stores the encoding of d at p, which must have room for 9 bytes, and
+ * returns its size.
+ */
+static inline size_t msgpack_store_uint(char* p, uint64_t d)
+{
+    unsigned int n;
+    if (d < 0x80) {
+        *p = d ? (char)d : (char)0x80;
+        return 1;
+    }
+    n = msgpack_pack_uint64_width(d);
+    p[0] = (char)(0x80 + n);
+    _msgpack_store64(p + 1, d << (64 - 8 * n));
+    return 1 + n;
+}
+
+/*
+ * RLP prefix for a string (offset 0x80) or list (offset 0xc0) payload of
+ * l bytes.
+ */
+static inline int msgpack_pack_prefix(msgpack_packer* x, unsigned char offset, uint64_t l)
+{
+    unsigned int n;
+    if (l < 56) {
+        unsigned char c = offset + (unsigned char)l;
+        msgpack_pack_append_buffer(x, &c, 1);
+    }
+    n = msgpack_pack_uint64_width(l);
+    return msgpack_pack_tagged_be(x, offset + 55 + n, l, n);
+}
+
+#define msgpack_pack_real_uint8(x, d) return msgpack_pack_uint(x, (uint64_t)(d))
+#define msgpack_pack_real_uint16(x, d) return msgpack_pack_uint(x, (uint64_t)(d))
+#define msgpack_pack_real_uint32(x, d) return msgpack_pack_uint(x, (uint64_t)(d))
+#define msgpack_pack_real_uint64(x, d) return msgpack_pack_uint(x, (uint64_t)(d))
 
 #define msgpack_pack_real_int8(x, d) \
 do { \
@@ -677,116 +667,62 @@ static inline int msgpack_pack_false(msgpack_packer* x)
  * Array
  */
 
-
-static inline int msgpack_clear_spot_for_start_byte(msgpack_packer* x)
+/*
+ * Size of the RLP prefix for a string or list payload of l bytes.
+ * Strings and lists share the same length rules, only the first byte differs.
+ */
+static inline size_t msgpack_pack_header_size(size_t l)
 {
-    unsigned char d = 0x00;
-    msgpack_pack_append_buffer(x, &d, 1);
-
+    if (l < 56) {
+        return 1;
+    }
+    return 1 + msgpack_pack_uint64_width((uint64_t)l);
 }
-static inline int msgpack_pack_array(msgpack_packer* x, size_t l, size_t position)
-{
-    if(l < 56) {
-        unsigned char d = 0xc0 | (uint8_t)l;
-        msgpack_pack_insert_buffer(x, &d, 1, position);
-    } else if ( l < 256) {
-        unsigned char buf[2] = {0xf8, (uint8_t)l};
-        msgpack_pack_insert_buffer(x, buf, 2, position);
-    } else if (l < 65536) {
-        unsigned char buf[3];
-        buf[0] = 0xf9; _msgpack_store16(&buf[1], (uint16_t)l);
-        msgpack_pack_insert_buffer(x, buf, 3, position);
-    } else if (l < 16777216){
-        //24 bit, 1 null bit to remove from 32 bit
-        unsigned char buf[4];
-        //uint32_t length_in_bytes = (uint32_t)l;
-        buf[0] = 0xfa;
-        unsigned char padded_buf[4];
-        //memcpy(&padded_buf[0], &length_in_bytes, 5);
-        _msgpack_store32(&padded_buf[0], (uint32_t)l);
-
-        buf[1] = padded_buf[1];
-        buf[2] = padded_buf[2];
-        buf[3] = padded_buf[3];
-        //buf[4] = padded_buf[0];
-
-        msgpack_pack_insert_buffer(x, buf, 4, position);
-    } else if (l < 4294967296){
-        //32 bit
-        unsigned char buf[5];
-        buf[0] = 0xfb; _msgpack_store32(&buf[1], (uint32_t)l);
-        msgpack_pack_insert_buffer(x, buf, 5, position);
 
-    } else if (l < 1099511627776){
-        //40 bit, 3 null bit to remove from 64 bit
-        unsigned char buf[6];
-        //uint64_t length_in_bytes = (uint64_t)l;
-        buf[0] = 0xfc;
-        unsigned char padded_buf[8];
-        //memcpy(&padded_buf[0], &length_in_bytes, 9);
-        _msgpack_store64(&padded_buf[0], (uint64_t)l);
-
-        buf[1] = padded_buf[3];
-        buf[2] = padded_buf[4];
-        buf[3] = padded_buf[5];
-        buf[4] = padded_buf[6];
-        buf[5] = padded_buf[7];
-
-        msgpack_pack_insert_buffer(x, buf, 6, position);
-    } else if (l < 281474976710656){
-        //48 bit, 2 null bit to remove from 64 bit
-        unsigned char buf[7];
-        //uint64_t length_in_bytes = (uint64_t)l;
-        buf[0] = 0xfd;
-        unsigned char padded_buf[8];
-        //memcpy(&padded_buf[0], &length_in_bytes, 9);
-        _msgpack_store64(&padded_buf[0], (uint64_t)l);
-
-        buf[1] = padded_buf[2];
-        buf[2] = padded_buf[3];
-        buf[3] = padded_buf[4];
-        buf[4] = padded_buf[5];
-        buf[5] = padded_buf[6];
-        buf[6] = padded_buf[7];
-
-        msgpack_pack_insert_buffer(x, buf, 7, position);
-    } else if (l < 72057594037927936){
-        //56 bit, 1 null bit to remove from 64 bit
-        unsigned char buf[8];
-        //uint64_t length_in_bytes = (uint64_t)l;
-        buf[0] = 0xfe;
-        unsigned char padded_buf[8];
-        //memcpy(&padded_buf[0], &length_in_bytes, 9);
-        _msgpack_store64(&padded_buf[0], (uint64_t)l);
-
-        buf[1] = padded_buf[1];
-        buf[2] = padded_buf[2];
-        buf[3] = padded_buf[3];
-        buf[4] = padded_buf[4];
-        buf[5] = padded_buf[5];
-        buf[6] = padded_buf[6];
-        buf[7] = padded_buf[7];
-
-        msgpack_pack_insert_buffer(x, buf, 8, position);
-    } else {
-        unsigned char buf[9];
-        buf[0] = 0xff; _msgpack_store64(&buf[1], (uint64_t)l);
-        msgpack_pack_insert_buffer(x, buf, 9, position);
+/*
+ * Size of a whole encoded unsigned integer, prefix included.
+ * 0 is encoded as the empty string and values below 0x80 as themselves.
+ */
+static inline size_t msgpack_pack_uint64_size(uint64_t d)
+{
+    if (d < 0x80) {
+        return 1;
     }
+    return 1 + msgpack_pack_uint64_width(d);
+}
 
+/*
+ * Writes the list prefix for a payload of l bytes. The caller must already
+ * know the payload size (see the sizing pass in _packer.pyx), so the prefix
+ * is always appended in front of the payload and nothing is ever shifted.
+ */
+static inline int msgpack_pack_array(msgpack_packer* x, size_t l)
+{
+    return msgpack_pack_prefix(x, 0xc0, (uint64_t)l);
+}
 
+/*
+ * Largest prefix: the tag byte and a 64 bit length.
+ */
+#define MSGPACK_MAX_HEADER_SIZE 9
 
+/*
+ * For payloads written before their size was known: writes the list prefix
+ * for the l bytes at payload into the memory right in front of them, which
+ * must have room for MSGPACK_MAX_HEADER_SIZE bytes. Returns the prefix size,
+ * the list starts that many bytes before payload.
+ */
+static inline size_t msgpack_pack_array_before(char* payload, size_t l)
+{
+    msgpack_packer x;
+    size_t n = msgpack_pack_header_size(l);
 
-
-//    else if(n < 65536) {
-//        unsigned char buf[3];
-//        buf[0] = 0xdc; _msgpack_store16(&buf[1], (uint16_t)n);
-//        msgpack_pack_append_buffer(x, buf, 3);
-//    } else {
-//        unsigned char buf[5];
-//        buf[0] = 0xdd; _msgpack_store32(&buf[1], (uint32_t)n);
-//        msgpack_pack_append_buffer(x, buf, 5);
-//    }
+    memset(&x, 0, sizeof(x));
+    x.buf = payload - n;
+    x.buf_size = n;
+    x.fixed = true;
+    msgpack_pack_array(&x, l);
+    return n;
 }
 
 
@@ -815,179 +751,9 @@ static inline int msgpack_pack_map(msgpack_packer* x, unsigned int n)
  * Raw
  */
 
-/*
- *#int len_len = ceil((floor(log2(l)) + 1)/8);
- *#int first_digit = len_len + 55 + 128;
- *
- */
 static inline int msgpack_pack_raw(msgpack_packer* x, size_t l)
 {
-
-
-    if (l < 56) {
-        unsigned char d = 0x80 | (uint8_t)l;
-        msgpack_pack_append_buffer(x, &TAKE8_8(d), 1);
-    } else if ( l < 256) {
-        unsigned char buf[2] = {0xb8, (uint8_t)l};
-        msgpack_pack_append_buffer(x, buf, 2);
-    } else if (l < 65536) {
-        unsigned char buf[3];
-        buf[0] = 0xb9; _msgpack_store16(&buf[1], (uint16_t)l);
-        msgpack_pack_append_buffer(x, buf, 3);
-    } else if (l < 16777216){
-        //24 bit, 1 null bit to remove from 32 bit
-        unsigned char buf[4];
-        //uint32_t length_in_bytes = (uint32_t)l;
-        buf[0] = 0xba;
-        unsigned char padded_buf[4];
-        //memcpy(&padded_buf[0], &length_in_bytes, 4);
-        _msgpack_store32(&padded_buf[0], (uint32_t)l);
-
-        buf[1] = padded_buf[1];
-        buf[2] = padded_buf[2];
-        buf[3] = padded_buf[3];
-        //buf[4] = padded_buf[0];
-
-        msgpack_pack_append_buffer(x, buf, 4);
-    } else if (l < 4294967296){
-        //32 bit
-        unsigned char buf[5];
-        buf[0] = 0xbb; _msgpack_store32(&buf[1], (uint32_t)l);
-        msgpack_pack_append_buffer(x, buf, 5);
-
-    } else if (l < 1099511627776){
-        //40 bit, 3 null bit to remove from 64 bit
-        unsigned char buf[6];
-        //uint64_t length_in_bytes = (uint64_t)l;
-        buf[0] = 0xbc;
-        unsigned char padded_buf[8];
-        //memcpy(&padded_buf[0], &length_in_bytes, 9);
-        _msgpack_store64(&padded_buf[0], (uint64_t)l);
-
-        buf[1] = padded_buf[3];
-        buf[2] = padded_buf[4];
-        buf[3] = padded_buf[5];
-        buf[4] = padded_buf[6];
-        buf[5] = padded_buf[7];
-
-        msgpack_pack_append_buffer(x, buf, 6);
-    } else if (l < 281474976710656){
-        //48 bit, 2 null bit to remove from 64 bit
-        unsigned char buf[7];
-        //uint64_t length_in_bytes = (uint64_t)l;
-        buf[0] = 0xbd;
-        unsigned char padded_buf[8];
-        //memcpy(&padded_buf[0], &length_in_bytes, 9);
-        _msgpack_store64(&padded_buf[0], (uint64_t)l);
-
-        buf[1] = padded_buf[2];
-        buf[2] = padded_buf[3];
-        buf[3] = padded_buf[4];
-        buf[4] = padded_buf[5];
-        buf[5] = padded_buf[6];
-        buf[6] = padded_buf[7];
-
-        msgpack_pack_append_buffer(x, buf, 7);
-    } else if (l < 72057594037927936){
-        //56 bit, 1 null bit to remove from 64 bit
-        unsigned char buf[8];
-        //uint64_t length_in_bytes = (uint64_t)l;
-        buf[0] = 0xbe;
-        unsigned char padded_buf[8];
-        //memcpy(&padded_buf[0], &length_in_bytes, 9);
-        _msgpack_store64(&padded_buf[0], (uint64_t)l);
-
-        buf[1] = padded_buf[1];
-        buf[2] = padded_buf[2];
-        buf[3] = padded_buf[3];
-        buf[4] = padded_buf[4];
-        buf[5] = padded_buf[5];
-        buf[6] = padded_buf[6];
-        buf[7] = padded_buf[7];
-
-        msgpack_pack_append_buffer(x, buf, 8);
-    } else {
-        unsigned char buf[9];
-        buf[0] = 0xbf; _msgpack_store64(&buf[1], (uint64_t)l);
-        msgpack_pack_append_buffer(x, buf, 9);
-    }
-
-
-//       if (l < 56) {
-//        unsigned char d = 0x80 | (uint8_t)l;
-//        msgpack_pack_append_buffer(x, &TAKE8_8(d), 1);
-//    }else if ( l < 256) {
-//        unsigned char buf[2] = {0xb8, (uint8_t)l};
-//        msgpack_pack_append_buffer(x, buf, 2);
-//    } else if (l < 65536) {
-//        unsigned char buf[3];
-//        buf[0] = 0xb9; _msgpack_store16(&buf[1], (uint16_t)l);
-//        msgpack_pack_append_buffer(x, buf, 3);
-//    } else if (l < 16777216){
-//        //24 bit
-//        unsigned char buf[4];
-//        unsigned char test = (uint32_t)l;
-//        buf[0] = 0xba; memcpy(&buf[1], &test, 3);
-//        msgpack_pack_append_buffer(x, buf, 4);
-//    } else if (l < 4294967296){
-//        //32 bit
-//        unsigned char buf[5];
-//        buf[0] = 0xba; _msgpack_store32(&buf[1], (uint32_t)l);
-//        msgpack_pack_append_buffer(x, buf, 5);
-//    } else {
-//        unsigned char buf[9];
-//        buf[0] = 0xbb; _msgpack_store64(&buf[1], (uint64_t)l);
-//        msgpack_pack_append_buffer(x, buf, 9);
-//    }
-
-
-//    if (l < 56) {
-//        unsigned char d = 0x80 | (uint8_t)l;
-//        msgpack_pack_append_buffer(x, &TAKE8_8(d), 1);
-//    }else if ( l < 256) {
-//        unsigned char buf[2] = {0xb8, (uint8_t)l};
-//        msgpack_pack_append_buffer(x, buf, 2);
-//    } else if (l < 65536) {
-//        unsigned char buf[3];
-//        buf[0] = 0xb9; _msgpack_store16(&buf[1], (uint16_t)l);
-//        msgpack_pack_append_buffer(x, buf, 3);
-//    } else if (l < 16777216){
-//        unsigned char buf[4];
-//        buf[0] = 0xba;
-//        unsigned char extra_buf[3];
-//        _msgpack_store32(&extra_buf[0], (uint32_t)l);
-//        memcpy(extra_buf[1], &buf, )
-//        msgpack_pack_append_buffer(x, buf, 5);
-//    } else if (l < 4294967296){
-//        unsigned char buf[4];
-//        buf[0] = 0xba; _msgpack_store32(&buf[1], (uint32_t)l);
-//        msgpack_pack_append_buffer(x, buf, 5);
-//    } else {
-//        unsigned char buf[9];
-//        buf[0] = 0xbb; _msgpack_store64(&buf[1], (uint64_t)l);
-//        msgpack_pack_append_buffer(x, buf, 9);
-//    }
-
-
-    if (l < 56) {
-        unsigned char d = 0x80 | (uint8_t)l;
-        msgpack_pack_append_buffer(x, &TAKE8_8(d), 1);
-    }else if ( l < 256) {
-        unsigned char buf[2] = {0xb8, (uint8_t)l};
-        msgpack_pack_append_buffer(x, buf, 2);
-    } else if (l < 65536) {
-        unsigned char buf[3];
-        buf[0] = 0xb9; _msgpack_store16(&buf[1], (uint16_t)l);
-        msgpack_pack_append_buffer(x, buf, 3);
-    } else if (l < 4294967296){
-        unsigned char buf[5];
-        buf[0] = 0xba; _msgpack_store32(&buf[1], (uint32_t)l);
-        msgpack_pack_append_buffer(x, buf, 5);
-    } else {
-        unsigned char buf[9];
-        buf[0] = 0xbb; _msgpack_store64(&buf[1], (uint64_t)l);
-        msgpack_pack_append_buffer(x, buf, 9);
-    }
+    return msgpack_pack_prefix(x, 0x80, (uint64_t)l);
 }
 
 /*
@@ -1018,6 +784,26 @@ static inline int msgpack_pack_raw_body(msgpack_packer* x, const void* b, size_t
     return 0;
 }
 
+/*
+ * A whole RLP string, prefix and body. A single byte below 0x80 is its own encoding.
+ */
+static inline size_t msgpack_pack_string_size(const void* b, size_t l)
+{
+    if (l == 1 && *(const unsigned char*)b < 0x80) {
+        return 1;
+    }
+    return msgpack_pack_header_size(l) + l;
+}
+
+static inline int msgpack_pack_string(msgpack_packer* x, const void* b, size_t l)
+{
+    if (!(l == 1 && *(const unsigned char*)b < 0x80)) {
+        int ret = msgpack_pack_raw(x, l);
+        if (ret) return ret;
+    }
+    return msgpack_pack_raw_body(x, b, l);
+}
+
 /*
  * Ext
  */
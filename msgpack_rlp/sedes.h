@@ -0,0 +1,208 @@
+/*
+ * Compiled sedes for the encoder
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_SEDES_H__
+#define MSGPACK_SEDES_H__
+
+// included by pack.h, after pack_template.h
+
+//
+// Sedes describe values node for node: 0 is bytes, 1 an unsigned int of at
+// most 64 bits, (0, n) bytes of exactly n bytes, (1, n) an unsigned int of at
+// most n bytes, a list of one sedes is a list of any length whose items all
+// have it and any other list is a record with one sedes per item. Unlike the sedes of unpackb, where an int sedes
+// covers a whole subtree, 0 and 1 never match a list.
+//
+// They are compiled into a flat array of nodes, the root first. Records
+// made only of fixed size items have a fixed size themselves, which is
+// computed here once: the encoder then writes their prefix without sizing
+// them.
+//
+typedef enum {
+    MSGPACK_SEDE_BYTES,
+    MSGPACK_SEDE_UINT,      // unsigned int of at most a given length
+    MSGPACK_SEDE_FIXED,     // bytes of a given length
+    MSGPACK_SEDE_RECORD,    // list of a given length, one sedes per item
+    MSGPACK_SEDE_REPEAT,    // list of any length, one sedes for all items
+} msgpack_sede_kind;
+
+typedef struct msgpack_sede {
+    msgpack_sede_kind kind;
+    size_t length;          // UINT and FIXED: bytes, RECORD: items
+    size_t items;           // RECORD: index of its first item in children,
+                            // REPEAT: node of its items
+    size_t payload;         // RECORD: payload size, when fixed
+    size_t size;            // encoded size, 0 when it varies
+} msgpack_sede;
+
+typedef struct msgpack_sedes {
+    msgpack_sede *nodes;
+    size_t length;
+    size_t buf_size;
+
+    size_t *children;       // item nodes of every record, back to back
+    size_t children_length;
+    size_t children_buf_size;
+} msgpack_sedes;
+
+#define MSGPACK_SEDE_ERROR ((size_t)-1)
+
+static inline void msgpack_sedes_free(msgpack_sedes* s)
+{
+    PyMem_Free(s->nodes);
+    PyMem_Free(s->children);
+    memset(s, 0, sizeof(msgpack_sedes));
+}
+
+static inline size_t msgpack_sedes_push(msgpack_sedes* s, msgpack_sede_kind kind)
+{
+    if (s->length == s->buf_size) {
+        size_t bs = s->buf_size ? s->buf_size * 2 : 16;
+        msgpack_sede* nodes = (msgpack_sede*)PyMem_Realloc(s->nodes, bs * sizeof(msgpack_sede));
+        if (!nodes) {
+            PyErr_NoMemory();
+            return MSGPACK_SEDE_ERROR;
+        }
+        s->nodes = nodes;
+        s->buf_size = bs;
+    }
+    memset(&s->nodes[s->length], 0, sizeof(msgpack_sede));
+    s->nodes[s->length].kind = kind;
+    return s->length++;
+}
+
+// reserves n entries of children, returns the first or MSGPACK_SEDE_ERROR
+static inline size_t msgpack_sedes_reserve_children(msgpack_sedes* s, size_t n)
+{
+    size_t first = s->children_length;
+    if (s->children_length + n > s->children_buf_size) {
+        size_t bs = s->children_buf_size ? s->children_buf_size : 16;
+        size_t* children;
+        while (bs < s->children_length + n)
+            bs *= 2;
+        children = (size_t*)PyMem_Realloc(s->children, bs * sizeof(size_t));
+        if (!children) {
+            PyErr_NoMemory();
+            return MSGPACK_SEDE_ERROR;
+        }
+        s->children = children;
+        s->children_buf_size = bs;
+    }
+    s->children_length += n;
+    return first;
+}
+
+static inline size_t msgpack_sedes_compile_node(msgpack_sedes* s, PyObject* spec);
+
+static inline size_t msgpack_sedes_compile_list(msgpack_sedes* s, PyObject* spec)
+{
+    Py_ssize_t i, n = PyList_GET_SIZE(spec);
+    size_t node, items, payload = 0;
+    bool fixed = true;
+
+    if (n == 1) {
+        node = msgpack_sedes_push(s, MSGPACK_SEDE_REPEAT);
+        if (node == MSGPACK_SEDE_ERROR)
+            return node;
+        items = msgpack_sedes_compile_node(s, PyList_GET_ITEM(spec, 0));
+        if (items == MSGPACK_SEDE_ERROR)
+            return items;
+        s->nodes[node].items = items;
+        return node;
+    }
+
+    node = msgpack_sedes_push(s, MSGPACK_SEDE_RECORD);
+    if (node == MSGPACK_SEDE_ERROR)
+        return node;
+    items = msgpack_sedes_reserve_children(s, n);
+    if (items == MSGPACK_SEDE_ERROR)
+        return items;
+    s->nodes[node].length = n;
+    s->nodes[node].items = items;
+    for (i = 0; i < n; i++) {
+        size_t item = msgpack_sedes_compile_node(s, PyList_GET_ITEM(spec, i));
+        if (item == MSGPACK_SEDE_ERROR)
+            return item;
+        s->children[items + i] = item;
+        if (s->nodes[item].size == 0)
+            fixed = false;
+        payload += s->nodes[item].size;
+    }
+    if (fixed) {
+        s->nodes[node].payload = payload;
+        s->nodes[node].size = msgpack_pack_header_size(payload) + payload;
+    }
+    return node;
+}
+
+static inline size_t msgpack_sedes_compile_node(msgpack_sedes* s, PyObject* spec)
+{
+    size_t node = MSGPACK_SEDE_ERROR;
+    long kind;
+
+    if (Py_EnterRecursiveCall(" while compiling sedes"))
+        return MSGPACK_SEDE_ERROR;
+    if (PyList_Check(spec)) {
+        node = msgpack_sedes_compile_list(s, spec);
+    } else if (PyTuple_Check(spec)) {
+        Py_ssize_t n;
+        if (PyTuple_GET_SIZE(spec) != 2 || !PyLong_Check(PyTuple_GET_ITEM(spec, 0)) ||
+                ((kind = PyLong_AsLong(PyTuple_GET_ITEM(spec, 0))) != 0 && kind != 1)) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError,
+                                "sedes tuples must be (0, length) or (1, length)");
+        } else if ((n = PyNumber_AsSsize_t(PyTuple_GET_ITEM(spec, 1), PyExc_OverflowError)) < 0) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "sedes length can't be negative");
+        } else if (kind == 1) {
+            if ((node = msgpack_sedes_push(s, MSGPACK_SEDE_UINT)) != MSGPACK_SEDE_ERROR)
+                s->nodes[node].length = n;
+        } else if ((node = msgpack_sedes_push(s, MSGPACK_SEDE_FIXED)) != MSGPACK_SEDE_ERROR) {
+            s->nodes[node].length = n;
+            // a single byte below 0x80 is its own encoding, so that one varies
+            if (n != 1)
+                s->nodes[node].size = msgpack_pack_header_size(n) + n;
+        }
+    } else if (PyLong_Check(spec)) {
+        kind = PyLong_AsLong(spec);
+        if (kind == 0) {
+            node = msgpack_sedes_push(s, MSGPACK_SEDE_BYTES);
+        } else if (kind == 1) {
+            node = msgpack_sedes_push(s, MSGPACK_SEDE_UINT);
+            if (node != MSGPACK_SEDE_ERROR)
+                s->nodes[node].length = 8;
+        } else if (!PyErr_Occurred()) {
+            PyErr_Format(PyExc_ValueError, "unknown sedes %ld", kind);
+        }
+    } else {
+        PyErr_Format(PyExc_TypeError,
+                     "sedes can only be lists, ints, (0, length) or (1, length), not %.200s",
+                     Py_TYPE(spec)->tp_name);
+    }
+    Py_LeaveRecursiveCall();
+    return node;
+}
+
+// compiles spec into s, which must be zeroed. -1 with an exception on error
+static inline int msgpack_sedes_compile(msgpack_sedes* s, PyObject* spec)
+{
+    if (msgpack_sedes_compile_node(s, spec) == MSGPACK_SEDE_ERROR) {
+        msgpack_sedes_free(s);
+        return -1;
+    }
+    return 0;
+}
+
+#endif /* msgpack/sedes.h */
@@ -0,0 +1,160 @@
+/*
+ * Scatter-gather output
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+#ifndef MSGPACK_SEGMENTS_H__
+#define MSGPACK_SEGMENTS_H__
+
+#include <errno.h>
+#include "batch.h"
+
+#ifdef _WIN32
+#include <io.h>
+typedef struct msgpack_iovec {
+    void *iov_base;
+    size_t iov_len;
+} msgpack_iovec;
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+typedef struct iovec msgpack_iovec;
+#endif
+
+// most iovecs passed to a single writev
+#define MSGPACK_IOV_MAX 1024
+
+//
+// Packer.pack_segments writes the snapshot of an object (see batch.h) as a
+// list of segments: everything small goes into the head buffer, while bytes,
+// RLPRaw and buffer object payloads of at least threshold bytes are left where
+// they are and referenced by the segment list instead of being copied.
+//
+typedef struct msgpack_segment {
+    PyObject *object;   // payload referenced in place, NULL for a head range
+    size_t start;       // head range
+    size_t length;
+} msgpack_segment;
+
+typedef struct msgpack_segments {
+    msgpack_packer head;
+    msgpack_segment *items;
+    size_t length;
+    size_t buf_size;
+} msgpack_segments;
+
+static inline void msgpack_segments_init(msgpack_segments* sg)
+{
+    memset(sg, 0, sizeof(msgpack_segments));
+}
+
+static inline void msgpack_segments_free(msgpack_segments* sg)
+{
+    msgpack_arena_release(sg->head.buf, sg->head.buf_size);
+    PyMem_Free(sg->items);
+    msgpack_segments_init(sg);
+}
+
+static inline int msgpack_segments_push(msgpack_segments* sg, PyObject* object,
+                                        size_t start, size_t length)
+{
+    if (length == 0)
+        return 0;
+    if (sg->length == sg->buf_size) {
+        size_t bs = sg->buf_size ? sg->buf_size * 2 : 16;
+        msgpack_segment* items = (msgpack_segment*)PyMem_Realloc(
+            sg->items, bs * sizeof(msgpack_segment));
+        if (!items) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        sg->items = items;
+        sg->buf_size = bs;
+    }
+    sg->items[sg->length].object = object;
+    sg->items[sg->length].start = start;
+    sg->items[sg->length].length = length;
+    sg->length++;
+    return 0;
+}
+
+static inline int msgpack_segments_build(msgpack_segments* sg, const msgpack_encoder* enc,
+                                         const msgpack_batch* b, size_t threshold)
+{
+    const msgpack_ir* ir = &b->ir;
+    size_t cut = 0;     // start of the pending head range
+    size_t i;
+
+    for (i = 0; i < ir->length; i++) {
+        const msgpack_ir_token* t = &ir->tokens[i];
+        bool referenced = t->object != NULL && t->length >= threshold &&
+            (t->kind == MSGPACK_IR_STRING || t->kind == MSGPACK_IR_VERBATIM);
+
+        if (!referenced) {
+            if (msgpack_ir_write(ir, enc->plan.sizes, i, i + 1, &sg->head))
+                return -1;
+            continue;
+        }
+        if (t->kind == MSGPACK_IR_STRING &&
+                !(t->length == 1 && *(const unsigned char*)t->data < 0x80)) {
+            if (msgpack_pack_raw(&sg->head, t->length))
+                return -1;
+        }
+        if (msgpack_segments_push(sg, NULL, cut, sg->head.length - cut) ||
+                msgpack_segments_push(sg, t->object, 0, t->length))
+            return -1;
+        cut = sg->head.length;
+    }
+    return msgpack_segments_push(sg, NULL, cut, sg->head.length - cut);
+}
+
+//
+// writes every buffer of iov to fd, retrying on partial writes. Returns 0 or
+// an errno value. Called without the GIL; iov is consumed.
+//
+static inline int msgpack_write_iovec(int fd, msgpack_iovec* iov, size_t n)
+{
+    for (;;) {
+        while (n && iov->iov_len == 0) {
+            iov++;
+            n--;
+        }
+        if (n == 0)
+            return 0;
+#ifdef _WIN32
+        unsigned int chunk = iov->iov_len > INT_MAX ? INT_MAX : (unsigned int)iov->iov_len;
+        Py_ssize_t w = _write(fd, iov->iov_base, chunk);
+#else
+        Py_ssize_t w = writev(fd, iov, n > MSGPACK_IOV_MAX ? MSGPACK_IOV_MAX : (int)n);
+#endif
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (w == 0)
+            return EIO;
+        // skip what went out
+        while (n && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+#endif /* msgpack/segments.h */
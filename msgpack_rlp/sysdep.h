@@ -20,6 +20,7 @@
 
 #include <stdlib.h>
 #include <stddef.h>
+#include <string.h>
 #if defined(_MSC_VER) && _MSC_VER < 1600
 typedef __int8 int8_t;
 typedef unsigned __int8 uint8_t;
@@ -239,6 +240,63 @@ typedef unsigned int _msgpack_atomic_counter_t;
 #define _msgpack_store64(to, num) \
     do { uint64_t val = _msgpack_be64(num); memcpy(to, &val, 8); } while(0)
 
+/*
+ * count leading zero bits of a non zero 64 bit value
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define _msgpack_clz64(x) ((unsigned int)__builtin_clzll(x))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+#include <intrin.h>
+static inline unsigned int _msgpack_clz64(uint64_t x)
+{
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return 63 - (unsigned int)i;
+}
+#elif defined(_MSC_VER)
+#include <intrin.h>
+static inline unsigned int _msgpack_clz64(uint64_t x)
+{
+    unsigned long i;
+    if (x >> 32) {
+        _BitScanReverse(&i, (unsigned long)(x >> 32));
+        return 31 - (unsigned int)i;
+    }
+    _BitScanReverse(&i, (unsigned long)x);
+    return 63 - (unsigned int)i;
+}
+#else
+static inline unsigned int _msgpack_clz64(uint64_t x)
+{
+    unsigned int n = 0;
+    while (!(x & 0x8000000000000000ULL)) {
+        x <<= 1;
+        ++n;
+    }
+    return n;
+}
+#endif
+
+/*
+ * loads a big endian unsigned integer of 1 to 8 bytes from p. When 8 bytes
+ * are readable it is a single unaligned byte-swapped load and a shift. Only
+ * the n bytes up to pe are known to exist, and nothing before p is: the
+ * unpacker may have just been fed the payload alone. So within 8 bytes of
+ * the end the bytes are copied into a zeroed word instead, which the shift
+ * then treats like the full load. That branch depends on where the integer
+ * sits in the input, not on its width, and is almost never taken.
+ */
+static inline uint64_t _msgpack_load_uint_be(const unsigned char* p, const unsigned char* pe, unsigned int n)
+{
+    uint64_t val = 0;
+    if (pe - p >= 8) {
+        memcpy(&val, p, 8);
+    } else {
+        memcpy((unsigned char*)&val, p, n);
+    }
+    return _msgpack_be64(val) >> (64 - 8 * n);
+}
+
 /*
 #define _msgpack_load16(cast, from) \
     ({ cast val; memcpy(&val, (char*)from, 2); _msgpack_be16(val); })
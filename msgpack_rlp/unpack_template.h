@@ -415,22 +415,9 @@ static inline int unpack_execute(unpack_context* ctx, const char* data, Py_ssize
                     if (trail == 0){
                         //This is a special case. RLP specs treat 0 like a byte string of length 0
                         push_fixed_value(_uint8, 0);
-                    } else if (trail == 1){
-                        push_fixed_value(_uint8, *(uint8_t*)n);
-                    } else if (trail == 2){
-                        push_fixed_value(_uint16, _msgpack_load16(uint16_t,n));
-                    } else if (trail == 3){
-                        push_fixed_value(_uint32, _msgpack_load24(uint32_t,n));
-                    } else if (trail == 4){
-                        push_fixed_value(_uint32, _msgpack_load32(uint32_t,n));
-                    } else if (trail == 5){
-                        push_fixed_value(_uint64, _msgpack_load40(uint64_t,n));
-                    } else if (trail == 6){
-                        push_fixed_value(_uint64, _msgpack_load48(uint64_t,n));
-                    } else if (trail == 7){
-                        push_fixed_value(_uint64, _msgpack_load56(uint64_t,n));
-                    } else if (trail == 8){
-                        push_fixed_value(_uint64, _msgpack_load64(uint64_t,n));
+                    } else if (trail <= 8){
+                        //one big endian load for every width, see _msgpack_load_uint_be
+                        push_fixed_value(_uint64, _msgpack_load_uint_be((const unsigned char*)n, pe, trail));
                     } else {
                         ret = 11;
                         //PyErr_SetString(PyExc_ValueError, "Attempted to decode an int, but it was larger than the maximum allowed size");
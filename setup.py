@@ -76,6 +76,9 @@ libraries = []
 if sys.platform == 'win32':
     libraries.append('ws2_32')
 
+# the batch encoder of the packer runs std::thread workers
+thread_args = [] if sys.platform == 'win32' else ['-pthread']
+
 if sys.byteorder == 'big':
     macros = [('__BIG_ENDIAN__', '1')]
 else:
@@ -89,6 +92,8 @@ if not hasattr(sys, 'pypy_version_info'):
                                  libraries=libraries,
                                  include_dirs=['.'],
                                  define_macros=macros,
+                                 extra_compile_args=thread_args,
+                                 extra_link_args=thread_args,
                                  ))
     ext_modules.append(Extension('msgpack_rlp._unpacker',
                                  sources=['msgpack_rlp/_unpacker.cpp'],
@@ -96,7 +101,7 @@ if not hasattr(sys, 'pypy_version_info'):
                                  include_dirs=['.'],
                                  define_macros=macros,
                                  ))
-del libraries, macros
+del libraries, macros, thread_args
 
 
 desc = 'MessagePack (de)serializer with Ethereum RLP encoding'
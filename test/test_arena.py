@@ -0,0 +1,35 @@
+#!/usr/bin/env python
+# coding: utf-8
+
+from msgpack_rlp import Packer, buffer_arena_stats, configure_buffer_arena
+
+
+def test_buffer_reuse():
+    for _ in range(10):
+        packer = Packer(autoreset=False)
+        packer.pack([b'a' * 100])
+        del packer
+    stats = buffer_arena_stats()
+    assert stats['hits'] > 0
+    assert stats['cached_bytes'] <= stats['high_water']
+
+
+def test_trim_after_spike():
+    before = buffer_arena_stats()['trims']
+    packer = Packer(autoreset=False)
+    packer.pack([b'x' * (4 << 20)])
+    assert packer.get_length() > 4 << 20
+    packer.reset()
+    assert buffer_arena_stats()['trims'] == before + 1
+    packer.pack([b'y'])
+    assert packer.bytes() == b'\xc1y'
+
+
+def test_configure():
+    stats = buffer_arena_stats()
+    try:
+        configure_buffer_arena(high_water=0)
+        assert buffer_arena_stats()['cached_bytes'] == 0
+    finally:
+        configure_buffer_arena(high_water=stats['high_water'], trim_size=stats['trim_size'])
+    assert buffer_arena_stats()['high_water'] == stats['high_water']
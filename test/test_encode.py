@@ -0,0 +1,777 @@
+#!/usr/bin/env python
+# coding: utf-8
+from __future__ import absolute_import, division, print_function, unicode_literals
+
+import array
+import gc
+import mmap
+import os
+import struct
+import sys
+import tempfile
+import threading
+
+import pytest
+from pytest import raises
+
+from msgpack_rlp import (packb, unpackb, encoded_length, pack_and_hash, Packer, ListBuilder,
+                         FileListEncoder, RLPRaw, Sedes, write_segments, register_type,
+                         unregister_type)
+
+
+def int_to_big_endian(value):
+    return value.to_bytes((value.bit_length() + 7) // 8, 'big')
+
+
+def encode_length(length, offset):
+    if length < 56:
+        return struct.pack('B', offset + length)
+    length_bytes = int_to_big_endian(length)
+    return struct.pack('B', offset + 55 + len(length_bytes)) + length_bytes
+
+
+def rlp_encode(obj):
+    """Reference RLP encoder used to check the C encoder."""
+    if isinstance(obj, (list, tuple)):
+        payload = b''.join(rlp_encode(item) for item in obj)
+        return encode_length(len(payload), 0xc0) + payload
+    if isinstance(obj, int):
+        obj = int_to_big_endian(obj)
+    elif isinstance(obj, str):
+        obj = obj.encode('utf-8')
+    else:
+        obj = bytes(obj)
+    if len(obj) == 1 and ord(obj) < 0x80:
+        return obj
+    return encode_length(len(obj), 0x80) + obj
+
+
+def test_nested_lists():
+    data = [b'a', [b'bc', [b'd' * 60, []], [[[[b'']]]]], 1024]
+    assert packb(data) == rlp_encode(data)
+
+
+def test_list_header_sizes():
+    for n in (0, 1, 54, 55, 56, 57, 255, 256, 65535, 65536):
+        data = [b'x' * n]
+        assert packb(data) == rlp_encode(data)
+        data = [[b'y'] * n]
+        assert packb(data) == rlp_encode(data)
+
+
+def test_large_nested_payload():
+    tx = [b'\x01' * 32, 12345678, b'\x02' * 20, [b'\x03' * 100] * 10]
+    block = [[tx] * 2000, [b'\x04' * 1024] * 2000]
+    assert packb(block) == rlp_encode(block)
+
+
+def test_multi_megabyte_payload():
+    data = [[b'z' * (1 << 20)] * 4, [b'w' * (3 << 20)]]
+    packed = packb(data)
+    assert packed == rlp_encode(data)
+    assert unpackb(packed, use_list=True) == data
+
+
+def test_default_is_called_once():
+    calls = []
+
+    class Custom(object):
+        pass
+
+    def default(o):
+        calls.append(o)
+        return [b'custom']
+
+    obj = Custom()
+    assert packb([obj, [obj]], default=default) == rlp_encode([[b'custom'], [[b'custom']]])
+    assert len(calls) == 2
+
+
+def test_autoreset_false_appends():
+    packer = Packer(autoreset=False)
+    packer.pack([b'a', b'b'])
+    packer.pack([[b'c']])
+    assert packer.bytes() == rlp_encode([b'a', b'b']) + rlp_encode([[b'c']])
+
+
+def test_negative_int():
+    with raises(ValueError):
+        packb([1, -1])
+
+
+def test_subclasses():
+    class MyBytes(bytes):
+        pass
+
+    class MyInt(int):
+        pass
+
+    data = [MyBytes(b'ab'), MyInt(300), bytearray(b'\x01'), (b'c', 0)]
+    assert packb(data) == rlp_encode([b'ab', 300, b'\x01', [b'c', 0]])
+
+
+def test_str():
+    samples = ['', 'a', '\x7f', '\x80', '\xe9', 'x' * 56, 'abcdefgh\xe9ijklmnop\xff', 'Ā',
+               '߿', 'ࠀ', '€' * 100, '\U00010000', 'a\U0001f600b' * 30]
+    for s in samples:
+        size = sys.getsizeof(s)
+        assert packb(s) == rlp_encode(s)
+        assert packb([s, [s]]) == rlp_encode([s, [s]])
+        assert encoded_length(s) == len(rlp_encode(s))
+        # no UTF-8 copy is left behind on the str
+        assert sys.getsizeof(s) == size
+    for s in ('\ud800', 'a\udfffb'):
+        with raises(UnicodeEncodeError):
+            packb(s)
+
+
+def test_strict_types():
+    with raises(TypeError):
+        packb((b'a',), strict_types=True)
+    assert packb((b'a',), strict_types=True, default=list) == rlp_encode([b'a'])
+
+
+def test_int_widths():
+    values = sorted(set(v for k in range(66) for v in (2 ** k - 1, 2 ** k, 2 ** k + 1)))
+    for value in values:
+        assert packb(value) == rlp_encode(value)
+    small = [value for value in values if value < 2 ** 64]
+    assert unpackb(packb(small), sedes=1, use_list=True) == small
+
+
+def test_big_int():
+    for value in (2 ** 64 - 1, 2 ** 64, 2 ** 70, 2 ** 255 + 1, 2 ** 256 - 1, 2 ** 256, 3 ** 1000):
+        assert packb(value) == rlp_encode(value)
+        assert packb([value, [value]]) == rlp_encode([value, [value]])
+    assert unpackb(packb(2 ** 256 - 1)) == b'\xff' * 32
+
+
+def test_big_negative_int():
+    with raises(ValueError):
+        packb(-2 ** 100)
+
+
+def test_nested_use():
+    packer = Packer(default=lambda o: packer.pack(b'x'))
+    with raises(RuntimeError):
+        packer.pack([b'p' * 90, object(), b'r' * 90])
+
+    def items():
+        yield packer.pack(b'q')
+
+    with raises(RuntimeError):
+        packer.pack([b'p' * 90, items(), b'r' * 90])
+    assert packer.pack([b'p' * 90, b'r' * 90]) == rlp_encode([b'p' * 90, b'r' * 90])
+    builder = ListBuilder(packer)
+    with raises(RuntimeError):
+        builder.append(object())
+
+
+def nested_empty(depth):
+    obj = []
+    expected = b'\xc0'
+    for _ in range(depth):
+        obj = [obj]
+        expected = encode_length(len(expected), 0xc0) + expected
+    return obj, expected
+
+
+def test_max_depth():
+    obj, expected = nested_empty(600)
+    with raises(ValueError):
+        packb(obj)
+    assert packb(obj, max_depth=600) == expected
+    with raises(ValueError):
+        packb(obj, max_depth=599)
+
+
+def test_very_deep_nesting():
+    obj, expected = nested_empty(100000)
+    assert packb(obj, max_depth=100000) == expected
+
+
+def test_self_reference():
+    obj = []
+    obj.append(obj)
+    with raises(ValueError):
+        packb(obj)
+
+
+def test_pack_into():
+    data = [b'a' * 100, [1, 2, 2 ** 200], b'xyz']
+    expected = rlp_encode(data)
+    packer = Packer()
+    buf = bytearray(len(expected) + 10)
+    assert packer.pack_into(data, buf, 3) == len(expected)
+    assert buf[:3] == b'\0' * 3
+    assert bytes(buf[3:3 + len(expected)]) == expected
+
+    small = bytearray(len(expected) - 1)
+    assert packer.pack_into(data, small) == len(expected)
+    assert small == bytearray(len(expected) - 1)
+
+    view = memoryview(bytearray(len(expected) + 5))
+    assert packer.pack_into(data, view[5:]) == len(expected)
+    assert view[5:].tobytes() == expected
+
+    with raises(TypeError):
+        packer.pack_into(data, b'read only')
+    with raises(ValueError):
+        packer.pack_into(data, buf, len(buf) + 1)
+
+
+def test_changed_while_packing():
+    inner = [b'a']
+
+    class Custom(object):
+        pass
+
+    def default(o):
+        inner.extend([b'b' * 100] * 10)
+        return b'custom'
+
+    with raises(RuntimeError):
+        packb([inner, Custom()], default=default)
+    packer = Packer()
+    with raises(RuntimeError):
+        packer.pack_into([inner, Custom()], bytearray(4096), 0)
+
+
+def test_packb_default_options_reused():
+    data = [b'a', [1, 2], b'b' * 60]
+    for _ in range(3):
+        assert packb(data) == rlp_encode(data)
+    with raises(ValueError):
+        packb([-1])
+    assert packb(data) == rlp_encode(data)
+
+    def default(o):
+        return packb([b'nested'])
+
+    assert packb([object()], default=default) == rlp_encode([rlp_encode([b'nested'])])
+    assert unpackb(packb(data)) == unpackb(bytearray(packb(data)))
+
+    # another thread packs while this one is still in a generator
+    results = []
+
+    def items():
+        thread = threading.Thread(target=lambda: results.append(packb(data)))
+        thread.start()
+        thread.join()
+        yield packb([b'nested'])
+
+    assert packb([items(), b'c' * 60]) == rlp_encode([[rlp_encode([b'nested'])], b'c' * 60])
+    assert results == [rlp_encode(data)]
+
+
+def test_pack_many():
+    objs = [b'a', [1, 2], b'b' * 100, [], 2 ** 100]
+    packer = Packer()
+    data, offsets = packer.pack_many(objs)
+    assert offsets.typecode in ('Q', 'L')
+    assert len(offsets) == len(objs) + 1
+    assert offsets[0] == 0 and offsets[-1] == len(data)
+    for i, obj in enumerate(objs):
+        assert data[offsets[i]:offsets[i + 1]] == rlp_encode(obj)
+    assert packer.pack_many(iter(objs))[0] == data
+    assert packer.pack_many([]) == (b'', offsets[:1])
+
+    with raises(ValueError):
+        packer.pack_many([b'a', -1])
+    assert packer.pack(b'xyz') == rlp_encode(b'xyz')
+
+
+def test_pack_many_no_autoreset():
+    packer = Packer(autoreset=False)
+    packer.pack(b'first')
+    data, offsets = packer.pack_many([b'a', b'bc'])
+    assert data == rlp_encode(b'a') + rlp_encode(b'bc')
+    assert list(offsets) == [0, 1, 4]
+    assert packer.bytes() == rlp_encode(b'first') + data
+
+
+def test_pack_batch():
+    objs = [[b'a' * i, i, 2 ** (i % 300), bytearray(b'q' * (i % 70)), (i, [b'', []])]
+            for i in range(2000)]
+    objs.append([[b'x' * 1000] * 100] * 100)
+    packer = Packer()
+    expected = packer.pack_many(objs)
+    for threads in (1, 2, 8, 0):
+        data, offsets = packer.pack_batch(objs, threads)
+        assert data == expected[0]
+        assert offsets == expected[1]
+    assert packer.pack_batch([]) == (b'', expected[1][:1])
+
+    class Custom(object):
+        pass
+
+    packer = Packer(default=lambda o: b'custom')
+    data, offsets = packer.pack_batch([Custom(), [Custom()]], 4)
+    assert data == rlp_encode(b'custom') + rlp_encode([b'custom'])
+    with raises(ValueError):
+        packer.pack_batch([b'a', -1])
+    with raises(ValueError):
+        packer.pack_batch([b'a'], -1)
+
+
+def test_rlpraw():
+    tx = [b'a' * 40, 12345, [b'x'] * 30]
+    encoded = rlp_encode(tx)
+    data = [RLPRaw(encoded), [RLPRaw(encoded)] * 3, b'tail', RLPRaw(b'\x05')]
+    expected = rlp_encode([tx, [tx] * 3, b'tail', 5])
+    assert packb(data) == expected
+    assert packb(data, strict_types=True) == expected
+    assert Packer().pack_batch([data, RLPRaw(encoded)], 2)[0] == expected + encoded
+    assert RLPRaw(memoryview(encoded)) == encoded
+
+    for bad in (b'', b'\x83ab', b'\xc0\xc0', b'\xb8\x02a', b'\x01\x02'):
+        with raises(ValueError):
+            RLPRaw(bad)
+
+
+def test_pack_segments():
+    big = b'x' * 10000
+    raw = RLPRaw(rlp_encode([b'y' * 5000]))
+    obj = [b'a', big, [raw, 300, b'\x01' * 4096], b'\x7f', b'z' * 100]
+    expected = rlp_encode([b'a', big, [[b'y' * 5000], 300, b'\x01' * 4096], b'\x7f', b'z' * 100])
+    packer = Packer()
+    for threshold in (1, 100, 4096, 10 ** 9):
+        segments = packer.pack_segments(obj, threshold)
+        assert b''.join(segments) == expected
+    segments = packer.pack_segments(obj)
+    assert any(s is big for s in segments)
+    assert any(s is raw for s in segments)
+    assert packer.pack_segments(b'') == [b'\x80']
+
+    # buffer objects are referenced too: what they hold when the segments are
+    # written is what gets written
+    data = bytearray(b'v' * 5000)
+    view = memoryview(data)
+    segments = packer.pack_segments([view, b'w'])
+    assert any(s is view for s in segments)
+    data[0:1] = b'V'
+    assert b''.join(segments) == rlp_encode([b'V' + b'v' * 4999, b'w'])
+    with raises(ValueError):
+        packer.pack_segments([-1])
+    with raises(ValueError):
+        packer.pack_segments(b'', 0)
+
+
+def test_write_segments():
+    obj = [b'y' * 20] * 3000
+    segments = Packer().pack_segments(obj, 10)
+    with tempfile.TemporaryFile() as f:
+        assert write_segments(f, segments) == len(packb(obj))
+        assert write_segments(f, []) == 0
+        f.seek(0)
+        assert f.read() == packb(obj)
+    r, w = os.pipe()
+    os.close(r)
+    os.close(w)
+    with raises(OSError):
+        write_segments(w, segments)
+
+
+def test_encoded_length():
+    class Custom(object):
+        pass
+
+    for obj in (b'', b'\x05', b'\x80', 0, 127, 128, 2 ** 64, 'hello', b'x' * 60, [],
+                [b'a', [b'b' * 100, 1024], [[]] * 70, RLPRaw(b'\x82ab')], (b'c',) * 1000):
+        assert encoded_length(obj) == len(packb(obj))
+    packer = Packer(default=lambda o: [b'custom'])
+    assert packer.encoded_length([Custom(), Custom()]) == len(packer.pack([Custom(), Custom()]))
+    assert encoded_length([Custom()], default=lambda o: b'abc') == 5
+    with raises(ValueError):
+        encoded_length([-1])
+    with raises(TypeError):
+        encoded_length([Custom()])
+
+
+def test_pack_and_hash():
+    empty_list = '1dcc4de8dec75d7aab85b567b6ccd41ad312451b948a7413f0a142fd40d49347'
+    empty_bytes = '56e81f171bcc55a6ff8345e692c0f86e5b48e01b996cadc001622fb5e363b421'
+    assert pack_and_hash([]) == (b'\xc0', bytes(bytearray.fromhex(empty_list)))
+    assert pack_and_hash(b'', digest_only=True) == bytes(bytearray.fromhex(empty_bytes))
+
+    # larger than the hashing window, with items straddling it
+    data = [b'x' * 40000, [b'y' * 17000, list(range(5000))], 'h\xe9llo' * 3000, b'z' * 100000]
+    encoded, digest = pack_and_hash(data)
+    assert encoded == rlp_encode(data)
+    assert len(digest) == 32
+    assert pack_and_hash(data, digest_only=True) == digest
+    # the same bytes in a single write
+    assert pack_and_hash(RLPRaw(encoded), digest_only=True) == digest
+
+    shared = [b'k' * 300] * 100
+    expected = pack_and_hash([shared, shared, (b'a', 1), (b'a', 1)])
+    packer = Packer(memoize=True)
+    for digest_only in (False, True, True):
+        result = packer.pack_and_hash([shared, shared, (b'a', 1), (b'a', 1)], digest_only)
+        assert result == (expected[1] if digest_only else expected)
+
+    packer = Packer(sedes=[0, [1]])
+    assert packer.pack_and_hash([b'a' * 20000, [1, 2]]) == pack_and_hash([b'a' * 20000, [1, 2]])
+    with raises(ValueError):
+        packer.pack_and_hash([1, [1]], digest_only=True)
+    with raises(ValueError):
+        pack_and_hash([1, -1])
+
+
+def test_list_builder():
+    builder = ListBuilder()
+    assert builder.finish() == b'\xc0'
+    for n in (1, 55, 56, 300, 70000):
+        items = [b'\x01' * (i % 7) for i in range(n)]
+        builder.extend(items)
+        assert len(builder) == n
+        assert builder.payload_length == sum(len(packb(item)) for item in items)
+        assert builder.finish() == packb(items)
+        assert len(builder) == 0
+
+    inner = ListBuilder()
+    inner.append(b'a' * 60)
+    inner.append(7)
+    outer = ListBuilder()
+    outer.append(inner)
+    outer.append(ListBuilder())
+    outer.append([inner.finish()])
+    assert outer.finish() == packb([[b'a' * 60, 7], [], [packb([b'a' * 60, 7])]])
+    with raises(ValueError):
+        outer.append(outer)
+
+    class Custom(object):
+        pass
+
+    builder = ListBuilder(Packer(default=lambda o: b'custom'))
+    builder.append(Custom())
+    with raises(ValueError):
+        builder.append([b'ok', -1])
+    with raises(TypeError):
+        ListBuilder().append(Custom())
+    assert builder.finish() == packb([b'custom'])
+
+
+def test_file_list_encoder(tmpdir):
+    path = str(tmpdir.join('list.rlp'))
+    for n in (0, 1, 56, 20000):
+        items = [[b'tx' * (i % 40), i] for i in range(n)]
+        with FileListEncoder(path, flush_size=4096) as encoder:
+            encoder.extend(items)
+            assert len(encoder) == n
+            assert encoder.payload_length == sum(len(packb(item)) for item in items)
+        with open(path, 'rb') as f:
+            assert f.read() == packb(items)
+        assert tmpdir.listdir() == [tmpdir.join('list.rlp')]
+
+    encoder = FileListEncoder(path)
+    encoder.append(b'a')
+    assert encoder.finish() == 2
+    with raises(ValueError):
+        encoder.append(b'b')
+
+    with raises(ValueError):
+        with FileListEncoder(str(tmpdir.join('failed.rlp'))) as encoder:
+            encoder.append(b'ok')
+            encoder.append(-1)
+    assert tmpdir.listdir() == [tmpdir.join('list.rlp')]
+
+    encoder = FileListEncoder(str(tmpdir.join('dropped.rlp')))
+    encoder.append(b'a')
+    del encoder
+    gc.collect()
+    assert tmpdir.listdir() == [tmpdir.join('list.rlp')]
+
+
+def test_iterables():
+    def rows(n):
+        for i in range(n):
+            yield [b'row', i, (b'x' * (i % 70) for _ in range(2))]
+
+    for n in (0, 1, 60, 1000):
+        expected = [[b'row', i, [b'x' * (i % 70)] * 2] for i in range(n)]
+        assert packb(rows(n)) == rlp_encode(expected)
+        assert packb([rows(n), b'tail']) == rlp_encode([expected, b'tail'])
+    assert packb(range(5)) == rlp_encode([0, 1, 2, 3, 4])
+    assert packb(set([b'a'])) == rlp_encode([b'a'])
+    assert packb(set([b'a']), default=lambda o: b'from-default') == rlp_encode(b'from-default')
+    assert packb(set([b'a']), default=lambda o: o) == rlp_encode([b'a'])
+    assert packb(iter([b'a']), default=lambda o: b'from-default') == rlp_encode([b'a'])
+    it = iter([b'a', b'b'])
+    assert packb([it, it]) == rlp_encode([[b'a', b'b'], []])
+    assert packb(iter([b'a']), strict_types=True) == rlp_encode([b'a'])
+    assert Packer().pack_batch([rows(3), iter([b'y'])])[0] == rlp_encode(
+        [[b'row', i, [b'x' * (i % 70)] * 2] for i in range(3)]) + rlp_encode([b'y'])
+
+    def broken():
+        yield b'a'
+        raise KeyError('broken')
+
+    with raises(KeyError):
+        packb([broken()])
+    with raises(TypeError):
+        packb({b'a': b'b'})
+    with raises(ValueError):
+        packb(iter([iter([b'a'])]), max_depth=1)
+
+
+def test_buffer_objects():
+    data = b'abcdefgh' * 1000
+    view = memoryview(data)
+    for part in (view[:0], view[:1], view[:56], view[5:5000], view):
+        assert packb(part) == rlp_encode(part.tobytes())
+    assert packb([view[:3], array.array(str('B'), b'xyz'), bytearray(b'q')]) == rlp_encode(
+        [b'abc', b'xyz', b'q'])
+    assert Packer().pack_batch([[view[:5000], b'k'], view[:1]])[0] == rlp_encode(
+        [data[:5000], b'k']) + b'a'
+    assert packb(view[:2], strict_types=True) == rlp_encode(b'ab')
+    with raises(TypeError):
+        packb(array.array(str('B'), b'x'), strict_types=True)
+    with raises(BufferError):
+        packb(view[::2])
+
+    resizable = bytearray(b'xyz')
+    packb(memoryview(resizable))
+    resizable.extend(b'released')
+
+    # pack_batch writes what the buffer held when it was read, even if it
+    # changes before the worker threads run
+    byte = bytearray(b'\x05')
+
+    def default(o):
+        byte[0] = 0xff
+        return b'x'
+
+    assert Packer(default=default).pack_batch([memoryview(byte), object()])[0] == b'\x05x'
+
+
+def test_int_arrays():
+    values = [0, 1, 0x7f, 0x80, 0xff, 0x100, 0xffff, 0x10000, 2 ** 24, 2 ** 32 - 1]
+    values64 = values + [2 ** 32, 2 ** 40, 2 ** 56, 2 ** 64 - 1] + [3 ** i for i in range(40)]
+    for typecode, items in (('I', values), ('L', values), ('Q', values64)):
+        ints = array.array(str(typecode), items)
+        assert packb(ints) == rlp_encode(items)
+        assert packb([memoryview(ints), b'x', ints[:3]]) == rlp_encode([items, b'x', items[:3]])
+        assert encoded_length(ints) == len(rlp_encode(items))
+        assert Packer().pack_batch([ints, [ints]])[0] == rlp_encode(items) + rlp_encode([items])
+    assert packb(array.array(str('Q'))) == b'\xc0'
+    assert packb(memoryview(struct.pack(str('>3Q'), 1, 300, 2 ** 40)).cast(str('Q'))) == \
+        rlp_encode(list(struct.unpack(str('=3Q'), struct.pack(str('>3Q'), 1, 300, 2 ** 40))))
+    for typecode in ('B', 'H', 'q', 'd'):
+        other = array.array(str(typecode), [1, 2])
+        assert packb(other) == rlp_encode(other.tobytes())
+
+
+def test_pack_columns():
+    n = 300
+    nonces = list(range(n))
+    to = [struct.pack(str('B'), i % 256) * 20 for i in range(n)]
+    values = [i * 10 ** 15 for i in range(n)]
+    data = [b'\x01' * (i % 70) for i in range(n)]
+    rows = [list(row) for row in zip(nonces, to, values, data)]
+    packer = Packer()
+    assert packer.pack_columns([nonces, to, values, data]) == rlp_encode(rows)
+    assert packer.pack_columns((tuple(nonces), iter(to))) == rlp_encode([r[:2] for r in rows])
+    assert packer.pack_columns([]) == b'\xc0'
+    assert packer.pack_columns([[], []]) == b'\xc0'
+
+    # typed columns are read in place
+    typed = [array.array(str('Q'), nonces), memoryview(b''.join(to)).cast(str('B'), (n, 20)),
+             array.array(str('I'), nonces[::-1])]
+    expected = [[i, to[i], n - 1 - i] for i in range(n)]
+    assert packer.pack_columns(typed) == rlp_encode(expected)
+    # other buffers are sequences of their items
+    small = [array.array(str('B'), [1, 200]), array.array(str('H'), [3, 60000])]
+    assert packer.pack_columns(small) == rlp_encode([[1, 3], [200, 60000]])
+
+    # cells are items of items of the packed list, at depth 2
+    nested = [[b'x']]
+    assert Packer(max_depth=4).pack_columns([[nested]]) == rlp_encode([[nested]])
+    with raises(ValueError):
+        Packer(max_depth=3).pack_columns([[nested]])
+    with raises(ValueError):
+        Packer(max_depth=1).pack_columns([nonces])
+
+    packer = Packer(default=lambda o: b'custom', memoize=True)
+    shared = [b'x', 1]
+    assert packer.pack_columns([[object(), shared], [shared, ()]]) == \
+        rlp_encode([[b'custom', shared], [shared, []]])
+
+    packer = Packer(sedes=[[1, (0, 20), 1]])
+    assert packer.pack_columns(typed) == rlp_encode(expected)
+    with raises(ValueError):
+        packer.pack_columns([nonces, data, values])
+    with raises(ValueError):
+        packer.pack_columns([nonces, to])
+    for spec in (0, [1, 0], [(0, 20), 1, 1]):
+        with raises(ValueError):
+            Packer(sedes=spec).pack_columns([nonces, to])
+
+    with raises(ValueError):
+        Packer().pack_columns([nonces, to[:5]])
+    with raises(ValueError):
+        Packer().pack_columns([[-1]])
+    with raises(TypeError):
+        Packer().pack_columns([array.array(str('d'), [1.0])])
+
+
+@pytest.mark.skipif(sys.version_info[0] < 3, reason="mmap has no buffer interface on python 2")
+def test_mmap(tmpdir):
+    data = b'abcdefgh' * 1000
+    path = tmpdir.join('pages')
+    path.write_binary(data)
+    with path.open('r+b') as f:
+        pages = mmap.mmap(f.fileno(), 0)
+        view = memoryview(pages)[8:16]
+        assert packb([pages, view]) == rlp_encode([data, data[8:16]])
+        view.release()
+        pages.close()
+
+
+def test_register_type():
+    class Tx(object):
+        __slots__ = (str('nonce'), str('to'), str('data'))
+
+        def __init__(self, nonce, to, data):
+            self.nonce, self.to, self.data = nonce, to, data
+
+    class Header(object):
+        __rlp_fields__ = (str('parent'), str('number'), str('txs'))
+
+        def __init__(self, parent, number, txs):
+            self.parent, self.number, self.txs = parent, number, txs
+
+        @property
+        def hash(self):
+            return b'h' * 4
+
+    register_type(Tx, [str('nonce'), str('to'), str('data')])
+    try:
+        txs = [Tx(i, b'\x11' * 20, b'x' * i) for i in range(3)]
+        expected = [[i, b'\x11' * 20, b'x' * i] for i in range(3)]
+        header = Header(b'\0' * 32, 7, txs)
+        assert packb(header) == rlp_encode([b'\0' * 32, 7, expected])
+        assert packb(txs[1], strict_types=True) == rlp_encode(expected[1])
+        assert encoded_length(header) == len(rlp_encode([b'\0' * 32, 7, expected]))
+        assert Packer().pack_batch([txs[0], header])[0] == \
+            rlp_encode(expected[0]) + rlp_encode([b'\0' * 32, 7, expected])
+
+        register_type(Header, [str('hash'), str('number')])
+        assert packb(header) == rlp_encode([b'h' * 4, 7])
+
+        with raises(AttributeError):
+            packb(Tx.__new__(Tx))
+        with raises(TypeError):
+            register_type(Tx, [1])
+        with raises(TypeError):
+            register_type(Exception)
+    finally:
+        unregister_type(Tx)
+        unregister_type(Header)
+    with raises(TypeError):
+        packb(Tx(1, b'', b''))
+
+
+def test_memoize():
+    addr = b'\x11' * 20
+    topics = [b'\x22' * 32, b'\x33' * 32]
+    log = [addr, topics, b'data']
+    block = [[log, log], [log, [addr, topics]]]
+    expected = rlp_encode(block)
+    packer = Packer(memoize=True)
+    assert packer.pack(block) == expected
+    assert packer.encoded_length(block) == len(expected)
+    assert packer.pack_batch([block, log])[0] == expected + rlp_encode(log)
+    assert b''.join(bytes(s) for s in packer.pack_segments(block, threshold=8)) == expected
+    assert packer.memo_stats()['shared'] > 0
+
+    key = (addr, 7, None, (b'x' * 40,))
+    for _ in range(3):
+        assert packer.pack([key, (addr, 7, None, (b'x' * 40,))]) == rlp_encode([key, key])
+    stats = packer.memo_stats()
+    assert stats['hits'] >= 4 and stats['entries'] >= 1
+    # equal but differently encoded values are never keys
+    assert packer.pack((RLPRaw(b'\x80'), 1)) == b'\xc2\x80\x01'
+    assert packer.pack((b'\x80', 1)) == b'\xc3\x81\x80\x01'
+    assert packer.pack((RLPRaw(b'\x80'), 1)) == b'\xc2\x80\x01'
+    # lists are only shared within a call
+    shared = [1, 2]
+    assert packer.pack([shared, shared]) == rlp_encode([[1, 2], [1, 2]])
+    shared.append(3)
+    assert packer.pack([shared, shared]) == rlp_encode([[1, 2, 3], [1, 2, 3]])
+
+    small = Packer(memoize=True, memo_size=2)
+    for i in range(5):
+        assert small.pack((i, b'y')) == rlp_encode([i, b'y'])
+    assert small.memo_stats()['evictions'] == 3
+    small.clear_memo()
+    assert small.memo_stats()['entries'] == 0
+    assert Packer().memo_stats() is None
+    with raises(ValueError):
+        Packer(memoize=True, memo_size=-1)
+
+
+def test_sedes():
+    tx_sedes = [1, 1, (0, 20), 0]
+    tx = [5, 21000, b'\x11' * 20, b'data']
+    packer = Packer(sedes=[tx_sedes])
+    assert packer.pack([tx, tuple(tx)]) == rlp_encode([tx, tx])
+    assert packer.encoded_length([tx]) == len(rlp_encode([tx]))
+    assert packer.pack_batch([[tx], []])[0] == rlp_encode([tx]) + b'\xc0'
+    for bad in ([[5, 21000, b'\x11' * 19, b'']],     # wrong fixed length
+                [[5, 21000, b'\x11' * 20]],          # missing field
+                [[-1, 21000, b'\x11' * 20, b'']],    # negative
+                [[2 ** 64, 0, b'\x11' * 20, b'']],   # wider than 64 bits
+                [[b'5', 0, b'\x11' * 20, b'']],      # bytes for an int
+                [tx, [0, 0, b'\x11' * 20, 'text']],
+                tx):
+        with raises(ValueError):
+            packer.pack(bad)
+
+    header = Sedes([(0, 32), (0, 20), [(0, 2)]])
+    assert header.fixed_size == len(rlp_encode([b'p' * 32, b'c' * 20, [b'ab']]))
+    assert Sedes(tx_sedes).fixed_size is None
+    assert Packer(sedes=header).pack([b'p' * 32, b'c' * 20, [b'ab', b'cd']]) == \
+        rlp_encode([b'p' * 32, b'c' * 20, [b'ab', b'cd']])
+    assert unpackb(Packer(sedes=[1]).pack([1, 2, 3]), sedes=[1], use_list=True) == [1, 2, 3]
+    # unlike for unpackb, an int sedes doesn't cover the lists below it
+    with raises(ValueError):
+        Packer(sedes=[1, 0]).pack([5, [b'a']])
+    assert Packer(sedes=[1, [0]]).pack([5, [b'a']]) == rlp_encode([5, [b'a']])
+
+    # integers of a given width, up to and past 64 bits
+    for width, good, bad in ((2, [0, 0xffff], [0x10000]),
+                             (32, [0, 2 ** 64, 2 ** 256 - 1], [2 ** 256, -1])):
+        packer = Packer(sedes=[(1, width)])
+        assert packer.pack(good) == rlp_encode(good)
+        assert packer.encoded_length(good) == len(rlp_encode(good))
+        for value in bad:
+            with raises(ValueError):
+                packer.pack([value])
+
+    class Tx(object):
+        __rlp_fields__ = (str('nonce'), str('to'))
+
+        def __init__(self, nonce, to):
+            self.nonce, self.to = nonce, to
+
+    assert Packer(sedes=[[1, (0, 20)]]).pack([Tx(1, b'\x22' * 20)]) == rlp_encode([[1, b'\x22' * 20]])
+    for spec in (2, [0, 5], (2, 3), (0, -1), (1, -1), 'x'):
+        with raises((TypeError, ValueError)):
+            Sedes(spec)
+
+
+def test_sedes_list_changed():
+    outer = []
+
+    class Clear(object):
+        __rlp_fields__ = (str('value'),)
+
+        @property
+        def value(self):
+            del outer[:]
+            return b'v'
+
+    outer[:] = [Clear(), b'a' * 40, b'b' * 40]
+    with raises(RuntimeError):
+        Packer(sedes=[[0]]).pack(outer)